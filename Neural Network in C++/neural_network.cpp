@@ -7,302 +7,4559 @@
 #include <iostream>
 #include <vector>
 #include <cmath>
+#include <numbers>
 #include <random>
 #include <fstream>
 #include <sstream>
+#include <spanstream>
 #include <string>
+#include <charconv>
 #include <algorithm>
 #include <iterator>
 #include <numeric>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <span>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <chrono>
+#include <deque>
+#include <list>
+#include <unordered_map>
+#include <array>
+#include <exception>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
-struct Neuron {
-    double value;
-    double bias;
+enum class Activation : uint8_t { ReLU, LeakyReLU, Tanh, Sigmoid, Identity };
+
+// Activation policies. derivative() is expressed in terms of the activation's output,
+// since that is what the forward pass keeps around for backpropagation.
+struct ReluActivation {
+    static double apply(double x) { return x > 0 ? x : 0; }
+    static double derivative(double y) { return y > 0 ? 1 : 0; }
+};
+
+struct LeakyReluActivation {
+    static constexpr double slope = 0.01;
+    static double apply(double x) { return x > 0 ? x : slope * x; }
+    static double derivative(double y) { return y > 0 ? 1 : slope; }
+};
+
+struct TanhActivation {
+    static double apply(double x) { return tanh(x); }
+    static double derivative(double y) { return 1 - y * y; }
+};
+
+struct SigmoidActivation {
+    static double apply(double x) { return 1 / (1 + exp(-x)); }
+    static double derivative(double y) { return y * (1 - y); }
+};
+
+struct IdentityActivation {
+    static double apply(double x) { return x; }
+    static double derivative(double) { return 1; }
+};
+
+// Calls body with the policy for a runtime activation, so the choice is made once per
+// layer and the kernels are instantiated per policy without per-element branches.
+template<typename Body>
+void withActivation(Activation activation, Body &&body) {
+    switch(activation) {
+        case Activation::ReLU: body(ReluActivation{}); break;
+        case Activation::LeakyReLU: body(LeakyReluActivation{}); break;
+        case Activation::Tanh: body(TanhActivation{}); break;
+        case Activation::Sigmoid: body(SigmoidActivation{}); break;
+        case Activation::Identity: body(IdentityActivation{}); break;
+    }
+}
+
+// Dot product with four independent accumulators so the additions can overlap and vectorize.
+double dot(const double *a, const double *b, size_t size) {
+    double sums[4] = {0, 0, 0, 0};
+    size_t i = 0;
+    for(; i + 4 <= size; i += 4) {
+        for(size_t k=0; k<4; ++k) {
+            sums[k] += a[i + k] * b[i + k];
+        }
+    }
+    for(; i<size; ++i) {
+        sums[0] += a[i] * b[i];
+    }
+    return (sums[0] + sums[1]) + (sums[2] + sums[3]);
+}
+
+// output = Act(input * weights^T + biases) for `batch` rows. Each weight row is read once and
+// applied to every row of the batch while it is still in cache, and bias add and activation are
+// applied while each dot product is still in a register instead of in a separate pass.
+template<typename Act>
+void denseForward(const double *weights, const double *biases, const double *input, double *output,
+    size_t batch, size_t inputSize, size_t outputSize) {
+    for(size_t o=0; o<outputSize; ++o) {
+        const double *w = weights + o * inputSize;
+        for(size_t b=0; b<batch; ++b) {
+            output[b * outputSize + o] = Act::apply(dot(w, input + b * inputSize, inputSize) + biases[o]);
+        }
+    }
+}
+
+// Sums of a 4-row by 8-output tile of input * weights, with the weights packed as one panel:
+// inputSize groups of 8 consecutive output columns, the right-hand matrix of a GEMM cut into
+// column strips. The tile stays in registers over the whole input, so every weight loaded serves
+// 4 rows and every input value 8 outputs, and every sum is still accumulated in input order.
+constexpr size_t tileRows = 4, tileColumns = 8;
+
+void packedTilePortable(const double *panel, const double *const rows[tileRows], size_t inputSize,
+    double sums[tileRows][tileColumns]) {
+    for(size_t i=0; i<inputSize; ++i) {
+        const double *w = panel + i * tileColumns;
+        for(size_t r=0; r<tileRows; ++r) {
+            double x = rows[r][i];
+            for(size_t c=0; c<tileColumns; ++c) {
+                sums[r][c] += x * w[c];
+            }
+        }
+    }
+}
+
+#if defined(__x86_64__)
+// AVX2/FMA version: eight named 4-wide accumulators (an array of them is not kept in registers),
+// two weight loads and four broadcasts per input.
+__attribute__((target("avx2,fma")))
+void packedTileAvx2(const double *panel, const double *const rows[tileRows], size_t inputSize,
+    double sums[tileRows][tileColumns]) {
+    const double *x0 = rows[0], *x1 = rows[1], *x2 = rows[2], *x3 = rows[3];
+    __m256d s0 = _mm256_setzero_pd(), t0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd(), t1 = _mm256_setzero_pd();
+    __m256d s2 = _mm256_setzero_pd(), t2 = _mm256_setzero_pd(), s3 = _mm256_setzero_pd(), t3 = _mm256_setzero_pd();
+    for(size_t i=0; i<inputSize; ++i) {
+        __m256d low = _mm256_loadu_pd(panel + i * tileColumns);
+        __m256d high = _mm256_loadu_pd(panel + i * tileColumns + 4);
+        __m256d x = _mm256_broadcast_sd(x0 + i);
+        s0 = _mm256_fmadd_pd(x, low, s0);
+        t0 = _mm256_fmadd_pd(x, high, t0);
+        x = _mm256_broadcast_sd(x1 + i);
+        s1 = _mm256_fmadd_pd(x, low, s1);
+        t1 = _mm256_fmadd_pd(x, high, t1);
+        x = _mm256_broadcast_sd(x2 + i);
+        s2 = _mm256_fmadd_pd(x, low, s2);
+        t2 = _mm256_fmadd_pd(x, high, t2);
+        x = _mm256_broadcast_sd(x3 + i);
+        s3 = _mm256_fmadd_pd(x, low, s3);
+        t3 = _mm256_fmadd_pd(x, high, t3);
+    }
+    _mm256_storeu_pd(sums[0], s0);
+    _mm256_storeu_pd(sums[0] + 4, t0);
+    _mm256_storeu_pd(sums[1], s1);
+    _mm256_storeu_pd(sums[1] + 4, t1);
+    _mm256_storeu_pd(sums[2], s2);
+    _mm256_storeu_pd(sums[2] + 4, t2);
+    _mm256_storeu_pd(sums[3], s3);
+    _mm256_storeu_pd(sums[3] + 4, t3);
+}
+#endif
+
+using PackedTile = void (*)(const double *, const double *const[tileRows], size_t, double[tileRows][tileColumns]);
+
+PackedTile selectPackedTile() {
+#if defined(__x86_64__)
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return packedTileAvx2;
+    }
+#endif
+    return packedTilePortable;
+}
+
+const PackedTile packedTile = selectPackedTile();
+
+// Size of a layer's weights packed by packPanels: every panel is padded to 8 columns.
+size_t packedPanelsSize(size_t outputSize, size_t inputSize) {
+    return (outputSize + tileColumns - 1) / tileColumns * inputSize * tileColumns;
+}
+
+// Packs row-major weights (outputSize rows of inputSize) into the panels read by packedTile.
+void packPanels(const double *weights, size_t outputSize, size_t inputSize, double *panels) {
+    fill_n(panels, packedPanelsSize(outputSize, inputSize), 0.0);
+    for(size_t o=0; o<outputSize; ++o) {
+        double *panel = panels + o / tileColumns * inputSize * tileColumns;
+        for(size_t i=0; i<inputSize; ++i) {
+            panel[i * tileColumns + o % tileColumns] = weights[o * inputSize + i];
+        }
+    }
+}
+
+// denseForward with weights packed by packPanels; rows are read and written at the given
+// strides. Panels are the outer loop, so one panel stays in cache while every row tile of the
+// batch goes through it. A short last tile repeats its first row and drops the extra sums.
+template<typename Act>
+void denseForwardPacked(const double *panels, const double *biases, const double *input, size_t inputStride,
+    double *output, size_t outputStride, size_t batch, size_t inputSize, size_t outputSize) {
+    for(size_t o0=0; o0<outputSize; o0+=tileColumns) {
+        const double *panel = panels + o0 * inputSize;
+        size_t columns = min(tileColumns, outputSize - o0);
+        for(size_t b0=0; b0<batch; b0+=tileRows) {
+            size_t rows = min(tileRows, batch - b0);
+            const double *rowInputs[tileRows];
+            for(size_t r=0; r<tileRows; ++r) {
+                rowInputs[r] = input + (b0 + (r < rows ? r : 0)) * inputStride;
+            }
+            double sums[tileRows][tileColumns] = {};
+            packedTile(panel, rowInputs, inputSize, sums);
+            for(size_t r=0; r<rows; ++r) {
+                for(size_t c=0; c<columns; ++c) {
+                    output[(b0 + r) * outputStride + o0 + c] = Act::apply(sums[r][c] + biases[o0 + c]);
+                }
+            }
+        }
+    }
+}
+
+// bfloat16 is the upper half of an IEEE float32: same exponent range, 8 bits of mantissa.
+uint16_t toBFloat16(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    if((bits & 0x7fffffff) > 0x7f800000) {
+        return static_cast<uint16_t>((bits >> 16) | 0x40);
+    }
+    bits += 0x7fff + ((bits >> 16) & 1);
+    return static_cast<uint16_t>(bits >> 16);
+}
+
+float fromBFloat16(uint16_t value) {
+    uint32_t bits = static_cast<uint32_t>(value) << 16;
+    float result;
+    memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+// Dot product of bfloat16 weights with float32 inputs, accumulated in float32. Eight independent
+// accumulators let the compiler vectorize the widening and the products for any target.
+float dotBFloat16Portable(const uint16_t *weights, const float *input, size_t size) {
+    float sums[8] = {};
+    size_t i = 0;
+    for(; i + 8 <= size; i += 8) {
+        for(size_t k=0; k<8; ++k) {
+            sums[k] += fromBFloat16(weights[i + k]) * input[i + k];
+        }
+    }
+    for(; i<size; ++i) {
+        sums[0] += fromBFloat16(weights[i]) * input[i];
+    }
+    return ((sums[0] + sums[1]) + (sums[2] + sums[3])) + ((sums[4] + sums[5]) + (sums[6] + sums[7]));
+}
+
+#if defined(__x86_64__)
+// AVX2/FMA version: widens eight weights at a time to float32 in registers, so only the 16-bit
+// values leave memory. It is compiled for AVX2 whatever the build's -march and only called on
+// CPUs that have it.
+__attribute__((target("avx2,fma")))
+float dotBFloat16Avx2(const uint16_t *weights, const float *input, size_t size) {
+    size_t i = 0;
+    __m256 accumulators[2] = {_mm256_setzero_ps(), _mm256_setzero_ps()};
+    for(; i + 16 <= size; i += 16) {
+        for(size_t k=0; k<2; ++k) {
+            __m128i packed = _mm_loadu_si128(reinterpret_cast<const __m128i *>(weights + i + 8 * k));
+            __m256 widened = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(packed), 16));
+            accumulators[k] = _mm256_fmadd_ps(widened, _mm256_loadu_ps(input + i + 8 * k), accumulators[k]);
+        }
+    }
+    __m256 accumulator = _mm256_add_ps(accumulators[0], accumulators[1]);
+    __m128 half = _mm_add_ps(_mm256_castps256_ps128(accumulator), _mm256_extractf128_ps(accumulator, 1));
+    half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+    half = _mm_add_ss(half, _mm_movehdup_ps(half));
+    float sum = _mm_cvtss_f32(half);
+    for(; i<size; ++i) {
+        sum += fromBFloat16(weights[i]) * input[i];
+    }
+    return sum;
+}
+#endif
+
+using BFloat16Dot = float (*)(const uint16_t *, const float *, size_t);
+
+// Picks the bfloat16 kernel for the CPU the program runs on, so portable builds get the AVX2 path too.
+BFloat16Dot selectDotBFloat16() {
+#if defined(__x86_64__)
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return dotBFloat16Avx2;
+    }
+#endif
+    return dotBFloat16Portable;
+}
+
+const BFloat16Dot dotBFloat16 = selectDotBFloat16();
+
+// denseForward over bfloat16 weights. The input batch is converted to float32 once into `scratch`.
+template<typename Act>
+void denseForwardBFloat16(const uint16_t *weights, const double *biases, const double *input, double *output,
+    size_t batch, size_t inputSize, size_t outputSize, vector<float> &scratch) {
+    scratch.resize(batch * inputSize);
+    copy_n(input, batch * inputSize, scratch.begin());
+    for(size_t o=0; o<outputSize; ++o) {
+        const uint16_t *w = weights + o * inputSize;
+        for(size_t b=0; b<batch; ++b) {
+            output[b * outputSize + o] = Act::apply(dotBFloat16(w, scratch.data() + b * inputSize, inputSize) + biases[o]);
+        }
+    }
+}
+
+// In-place softmax over one row of logits.
+void softmax(double *values, size_t size) {
+    double maxElement = *max_element(values, values + size);
+    double expSum = 0;
+    for(size_t i=0; i<size; ++i) {
+        values[i] = exp(values[i] - maxElement);
+        expSum += values[i];
+    }
+    for(size_t i=0; i<size; ++i) {
+        values[i] /= expSum;
+    }
+}
+
+// A fully connected layer; weights are stored row-major with one row of inputSize weights per output.
+// When packedWeights is filled, forward() reads that bfloat16 copy instead and `weights` remains the
+// full-precision master that training updates.
+class Layer {  
+public:
+    size_t inputSize;
+    size_t outputSize;
+    Activation activation;
     vector<double> weights;
+    vector<double> biases;
+    vector<uint16_t> packedWeights;
+
+    Layer(int neuronCount, int prevLayerNeuronCount, Activation activation = Activation::ReLU)
+        : inputSize(prevLayerNeuronCount), outputSize(neuronCount), activation(activation),
+          weights(inputSize * outputSize), biases(outputSize) {
+        random_device rd;
+        mt19937 gen(rd());
+        uniform_real_distribution<> dis(-1, 1);
+
+        generate(weights.begin(), weights.end(), [&](){ return dis(gen); });
+        generate(biases.begin(), biases.end(), [&](){ return dis(gen); });
+    }
+
+    void packWeights() {
+        packedWeights.resize(weights.size());
+        transform(weights.begin(), weights.end(), packedWeights.begin(), [](double w) { return toBFloat16(static_cast<float>(w)); });
+    }
+
+    void packRow(size_t row) {
+        for(size_t i=row * inputSize; i<(row + 1) * inputSize; ++i) {
+            packedWeights[i] = toBFloat16(static_cast<float>(weights[i]));
+        }
+    }
+
+    void forward(const double *input, double *output, size_t batch, vector<float> &scratch) const {
+        withActivation(activation, [&](auto policy) {
+            if(packedWeights.empty()) {
+                denseForward<decltype(policy)>(weights.data(), biases.data(), input, output, batch, inputSize, outputSize);
+            }
+            else {
+                denseForwardBFloat16<decltype(policy)>(packedWeights.data(), biases.data(), input, output,
+                    batch, inputSize, outputSize, scratch);
+            }
+        });
+    }
+};
+
+// Scratch buffers for one caller of the forward and backward passes. activations[0] holds the
+// normalized input batch and activations[l + 1] the output of layer l; with activation
+// checkpointing, boundaries that are not kept are empty and their buffers wait in `pool`.
+struct Workspace {
+    size_t batch = 0;
+    vector<vector<double>> activations;
+    vector<vector<double>> pool;
+    vector<double> deltas;
+    vector<double> previousDeltas;
+    vector<float> inputScratch;
+    vector<size_t> sampledClasses;
+    vector<double> sampledLogits;
+    // One row of the student's softened probabilities during distillation.
+    vector<double> targets;
+    // The min-heap of NeuralNetwork::predictTopK.
+    vector<pair<double, int>> topK;
+    vector<vector<double>> gradients;
+
+    // Highest activationBytes() seen by acquire, the memory a step actually needed.
+    size_t peakActivationBytes = 0;
+
+    // Only boundaries that are released again (`pooled`) draw from the pool, so a kept boundary
+    // such as the small output layer never takes a pooled buffer away from the boundaries that
+    // share it. Of the pooled buffers, the smallest that holds `size` is taken, or else the largest.
+    double *acquire(size_t boundary, size_t size, bool pooled = false) {
+        vector<double> &buffer = activations[boundary];
+        if(pooled && buffer.capacity() == 0 && !pool.empty()) {
+            auto byCapacity = [](const vector<double> &a, const vector<double> &b) { return a.capacity() < b.capacity(); };
+            auto fit = max_element(pool.begin(), pool.end(), byCapacity);
+            for(auto it=pool.begin(); it!=pool.end(); ++it) {
+                if(it->capacity() >= size && it->capacity() < fit->capacity()) {
+                    fit = it;
+                }
+            }
+            buffer = move(*fit);
+            pool.erase(fit);
+        }
+        buffer.resize(size);
+        peakActivationBytes = max(peakActivationBytes, activationBytes());
+        return buffer.data();
+    }
+
+    void release(size_t boundary) {
+        pool.push_back(move(activations[boundary]));
+        activations[boundary] = vector<double>();
+    }
+
+    // Bytes held for activations, including pooled buffers waiting to be reused.
+    size_t activationBytes() const {
+        size_t bytes = 0;
+        for(const vector<double> &buffer: activations) {
+            bytes += buffer.capacity() * sizeof(double);
+        }
+        for(const vector<double> &buffer: pool) {
+            bytes += buffer.capacity() * sizeof(double);
+        }
+        return bytes;
+    }
+
+    // Bytes held by every buffer, activations included.
+    size_t bytes() const {
+        size_t total = activationBytes() + (deltas.capacity() + previousDeltas.capacity() + sampledLogits.capacity() + targets.capacity()) *
+            sizeof(double) +
+            inputScratch.capacity() * sizeof(float) + sampledClasses.capacity() * sizeof(size_t) + topK.capacity() * sizeof(pair<double, int>);
+        for(const vector<double> &gradient: gradients) {
+            total += gradient.capacity() * sizeof(double);
+        }
+        return total;
+    }
+};
+
+struct MemoryPlanOptions {
+    size_t checkpointInterval = 0;
+    bool bfloat16Weights = false;
+    size_t sampledSoftmaxClasses = 0;
+    // Gradients kept apart from the weights, as computeGradients does for data-parallel training.
+    bool separateGradients = false;
+    bool keepBestWeights = false;
+    // Rows in the training set, for the row order that is shuffled every epoch.
+    size_t rows = 0;
+    // Rows per batch of the validation pass at the end of each epoch, 0 without validation.
+    size_t validationBatch = 0;
+    // Size bound of one serialized checkpoint, 0 without checkpoints. AsyncCheckpointer keeps three
+    // buffers of it: one being filled, one pending and one being written.
+    size_t checkpointBytes = 0;
+    // Plans a forward pass only: no deltas, gradients, labels or sampled softmax buffers.
+    bool inferenceOnly = false;
+    // Adds the soft target row of NeuralNetwork::distillStep.
+    bool distillation = false;
+    // Classes per row that NeuralNetwork::predictTopK will be asked for, 0 if it is not used.
+    size_t topK = 0;
+};
+
+// Heap bytes of one training configuration, by category. Activation and workspace buffers are
+// exactly what NeuralNetwork::reserveWorkspace allocates and what a training step then uses.
+struct MemoryPlan {
+    size_t weightBytes = 0;
+    size_t gradientBytes = 0;
+    size_t optimizerStateBytes = 0;
+    size_t snapshotBytes = 0;
+    size_t activationBytes = 0;
+    size_t workspaceBytes = 0;
+    size_t stagingBytes = 0;
+    size_t validationBytes = 0;
+    size_t checkpointBytes = 0;
+    // Activation buffer sizes in doubles, per layer boundary, plus how many pooled buffers of
+    // poolSize doubles the non-kept boundaries share when checkpointing.
+    vector<size_t> boundarySizes;
+    size_t poolCount = 0;
+    size_t poolSize = 0;
+    // Other workspace buffer sizes, in elements.
+    size_t deltaSize = 0;
+    size_t scratchSize = 0;
+    size_t sampledClassCount = 0;
+    size_t sampledLogitSize = 0;
+    size_t targetSize = 0;
+    size_t topKSize = 0;
+    vector<size_t> gradientSizes;
+
+    size_t total() const {
+        return weightBytes + gradientBytes + optimizerStateBytes + snapshotBytes + activationBytes + workspaceBytes + stagingBytes +
+            validationBytes + checkpointBytes;
+    }
+
+    void print(ostream &out) const {
+        auto mib = [](size_t bytes) { return to_string(bytes) + " bytes (" + to_string(bytes / double(1 << 20)) + " MiB)"; };
+        out << "Weights: " << mib(weightBytes) << endl;
+        out << "Gradients: " << mib(gradientBytes) << endl;
+        out << "Optimizer state: " << mib(optimizerStateBytes) << endl;
+        out << "Best-weights snapshot: " << mib(snapshotBytes) << endl;
+        out << "Activations: " << mib(activationBytes) << endl;
+        out << "Workspace: " << mib(workspaceBytes) << endl;
+        out << "Batch staging: " << mib(stagingBytes) << endl;
+        out << "Validation pass: " << mib(validationBytes) << endl;
+        out << "Checkpoint buffers: " << mib(checkpointBytes) << endl;
+        out << "Total: " << mib(total()) << endl;
+    }
+};
+
+// The validation pass runs the training network's weights forward with its own workspace.
+MemoryPlanOptions inferencePlanOptions(const MemoryPlanOptions &options) {
+    MemoryPlanOptions inference;
+    inference.checkpointInterval = options.checkpointInterval;
+    inference.bfloat16Weights = options.bfloat16Weights;
+    inference.inferenceOnly = true;
+    return inference;
+}
+
+// layerSizes starts with the input size, as for the NeuralNetwork constructor. Plain SGD updates
+// the weights in place, so it has no optimizer state; the backward pass only needs the deltas of
+// two adjacent layers at a time.
+MemoryPlan planMemory(const vector<int> &layerSizes, size_t batch, const MemoryPlanOptions &options) {
+    MemoryPlan plan;
+    size_t boundaries = layerSizes.size();
+    size_t layerCount = boundaries - 1;
+    size_t maxInput = 0, maxDelta = 0;
+    for(size_t l=0; l<layerCount; ++l) {
+        size_t weights = size_t(layerSizes[l]) * layerSizes[l + 1];
+        plan.weightBytes += (weights + layerSizes[l + 1]) * sizeof(double);
+        if(options.bfloat16Weights) {
+            plan.weightBytes += weights * sizeof(uint16_t);
+        }
+        if(options.separateGradients) {
+            plan.gradientSizes.push_back(weights + layerSizes[l + 1]);
+            plan.gradientBytes += plan.gradientSizes.back() * sizeof(double);
+        }
+        maxInput = max<size_t>(maxInput, layerSizes[l]);
+        maxDelta = max<size_t>(maxDelta, layerSizes[l + 1]);
+    }
+    // The snapshot is a copy of the layers, packed weights included.
+    if(options.keepBestWeights) {
+        plan.snapshotBytes = plan.weightBytes;
+    }
+
+    // Boundaries 0 and layerCount and every checkpointInterval-th one keep their own buffer; the
+    // others share pooled buffers, as many as the longest run of non-kept boundaries.
+    size_t interval = options.checkpointInterval;
+    plan.boundarySizes.assign(boundaries, 0);
+    size_t run = 0;
+    for(size_t b=0; b<boundaries; ++b) {
+        bool kept = interval == 0 || b == 0 || b == layerCount || b % interval == 0;
+        if(kept) {
+            plan.boundarySizes[b] = batch * layerSizes[b];
+            run = 0;
+        }
+        else {
+            plan.poolCount = max(plan.poolCount, ++run);
+            plan.poolSize = max<size_t>(plan.poolSize, batch * layerSizes[b]);
+        }
+    }
+    plan.activationBytes = (accumulate(plan.boundarySizes.begin(), plan.boundarySizes.end(), size_t(0)) +
+        plan.poolCount * plan.poolSize) * sizeof(double);
+
+    bool training = !options.inferenceOnly;
+    plan.deltaSize = training ? batch * maxDelta : 0;
+    plan.scratchSize = options.bfloat16Weights ? batch * maxInput : 0;
+    plan.sampledClassCount = training ? options.sampledSoftmaxClasses : 0;
+    plan.sampledLogitSize = plan.sampledClassCount > 0 ? batch * (plan.sampledClassCount + 1) : 0;
+    plan.targetSize = training && options.distillation ? layerSizes.back() : 0;
+    plan.topKSize = min<size_t>(options.topK, layerSizes.back());
+    plan.workspaceBytes = (2 * plan.deltaSize + plan.sampledLogitSize + plan.targetSize) * sizeof(double) + plan.scratchSize * sizeof(float) +
+        plan.sampledClassCount * sizeof(size_t) + plan.topKSize * sizeof(pair<double, int>);
+    plan.stagingBytes = batch * (layerSizes[0] * sizeof(double) + (training ? sizeof(int) : 0)) + options.rows * sizeof(uint32_t);
+
+    // The validation pass adds its own activations, input batch and confusion matrix.
+    if(options.validationBatch > 0) {
+        MemoryPlan validation = planMemory(layerSizes, options.validationBatch, inferencePlanOptions(options));
+        size_t classes = layerSizes.back();
+        plan.validationBytes = validation.activationBytes + validation.workspaceBytes + validation.stagingBytes +
+            classes * classes * sizeof(uint64_t);
+    }
+    plan.checkpointBytes = 3 * options.checkpointBytes;
+    return plan;
+}
+
+// Owns a dataset as one contiguous row-major feature matrix plus compact class labels.
+struct Dataset {
+    size_t featureCount = 0;
+    size_t classCount = 0;
+    vector<double> features;
+    vector<uint16_t> labels;
+
+    size_t size() const {
+        return labels.size();
+    }
+
+    span<const double> row(size_t i) const {
+        return {features.data() + i * featureCount, featureCount};
+    }
+
+    void addRow(span<const double> input, int label) {
+        features.insert(features.end(), input.begin(), input.end());
+        labels.push_back(static_cast<uint16_t>(label));
+    }
+};
+
+// A subset or ordering of a Dataset expressed as row indices, so splits, folds and
+// shuffles never copy feature data.
+struct DatasetView {
+    const Dataset *dataset = nullptr;
+    vector<uint32_t> indices;
+
+    DatasetView() = default;
+
+    explicit DatasetView(const Dataset &dataset) : dataset(&dataset), indices(dataset.size()) {
+        iota(indices.begin(), indices.end(), 0);
+    }
+
+    size_t size() const {
+        return indices.size();
+    }
+
+    span<const double> row(size_t i) const {
+        return dataset->row(indices[i]);
+    }
+
+    int label(size_t i) const {
+        return dataset->labels[indices[i]];
+    }
+
+    DatasetView slice(size_t begin, size_t end) const {
+        DatasetView view;
+        view.dataset = dataset;
+        view.indices.assign(indices.begin() + begin, indices.begin() + end);
+        return view;
+    }
+
+    void shuffle(mt19937 &gen) {
+        std::shuffle(indices.begin(), indices.end(), gen);
+    }
+};
+
+// Shuffles the rows once and cuts the permutation into train and validation views.
+pair<DatasetView, DatasetView> splitDataset(const Dataset &dataset, double trainSplit, double validationSplit, mt19937 &gen) {
+    DatasetView all(dataset);
+    all.shuffle(gen);
+    size_t trainSize = static_cast<size_t>(dataset.size() * trainSplit);
+    size_t validationSize = min(static_cast<size_t>(dataset.size() * validationSplit), dataset.size() - trainSize);
+    return {all.slice(0, trainSize), all.slice(trainSize, trainSize + validationSize)};
+}
+
+// Returns the train and validation views of fold `fold` out of `foldCount` over `view`.
+pair<DatasetView, DatasetView> crossValidationFold(const DatasetView &view, size_t foldCount, size_t fold) {
+    size_t begin = view.size() * fold / foldCount;
+    size_t end = view.size() * (fold + 1) / foldCount;
+    DatasetView train = view.slice(0, begin);
+    train.indices.insert(train.indices.end(), view.indices.begin() + end, view.indices.end());
+    return {train, view.slice(begin, end)};
+}
+
+// On-disk dataset format used for out-of-core training: a fixed header followed by
+// rowCount records of featureCount float32 features and one uint16 class label.
+struct BinaryDatasetHeader {
+    char magic[4] = {'N', 'N', 'D', 'S'};
+    uint32_t version = 1;
+    uint64_t rowCount = 0;
+    uint32_t featureCount = 0;
+    uint32_t classCount = 0;
+};
+
+// Streams a binary dataset in fixed-size chunks. Chunks are visited in a shuffled order and
+// rows go through a shuffle buffer, which gives an approximately global shuffle while only
+// one chunk and the shuffle buffer are ever resident.
+class DatasetStream {
+public:
+    BinaryDatasetHeader header;
+
+    DatasetStream(const string &filename, size_t chunkRows = 4096, size_t shuffleBufferRows = 65536,
+        unsigned seed = random_device{}())
+        : file(filename, ios::binary), chunkRows(max<size_t>(chunkRows, 1)),
+          shuffleBufferRows(max<size_t>(shuffleBufferRows, 1)), gen(seed) {
+        if(!file || !file.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+            memcmp(header.magic, "NNDS", 4) != 0 || header.version != 1) {
+            throw runtime_error("Not a binary dataset: " + filename);
+        }
+        recordSize = header.featureCount * sizeof(float) + sizeof(uint16_t);
+        size_t chunkCount = (header.rowCount + this->chunkRows - 1) / this->chunkRows;
+        chunkOrder.resize(chunkCount);
+        iota(chunkOrder.begin(), chunkOrder.end(), 0);
+        chunk.resize(this->chunkRows * recordSize);
+        bufferFeatures.reserve(this->shuffleBufferRows * header.featureCount);
+        bufferLabels.reserve(this->shuffleBufferRows);
+    }
+
+    // Upper bound on the bytes held by the chunk and shuffle buffers.
+    size_t memoryBound() const {
+        return chunk.size() + shuffleBufferRows * (header.featureCount * sizeof(float) + sizeof(uint16_t));
+    }
+
+    void beginEpoch() {
+        shuffle(chunkOrder.begin(), chunkOrder.end(), gen);
+        nextChunk = 0;
+        chunkRowsLoaded = 0;
+        chunkPosition = 0;
+        bufferFeatures.clear();
+        bufferLabels.clear();
+        while(bufferLabels.size() < shuffleBufferRows && readRecord()) {}
+    }
+
+    bool next(vector<double> &input, int &label) {
+        if(bufferLabels.empty()) {
+            return false;
+        }
+        size_t featureCount = header.featureCount;
+        size_t pick = uniform_int_distribution<size_t>(0, bufferLabels.size() - 1)(gen);
+        input.assign(bufferFeatures.begin() + pick * featureCount, bufferFeatures.begin() + (pick + 1) * featureCount);
+        label = bufferLabels[pick];
+
+        // Move the last row into the freed slot, then top the buffer up from the stream.
+        size_t last = bufferLabels.size() - 1;
+        copy_n(bufferFeatures.begin() + last * featureCount, featureCount, bufferFeatures.begin() + pick * featureCount);
+        bufferLabels[pick] = bufferLabels[last];
+        bufferFeatures.resize(last * featureCount);
+        bufferLabels.pop_back();
+        readRecord();
+        return true;
+    }
+
+private:
+    ifstream file;
+    size_t chunkRows;
+    size_t shuffleBufferRows;
+    size_t recordSize;
+    mt19937 gen;
+    vector<size_t> chunkOrder;
+    size_t nextChunk = 0;
+    vector<char> chunk;
+    size_t chunkRowsLoaded = 0;
+    size_t chunkPosition = 0;
+    vector<float> bufferFeatures;
+    vector<uint16_t> bufferLabels;
+
+    bool loadNextChunk() {
+        if(nextChunk == chunkOrder.size()) {
+            return false;
+        }
+        size_t first = chunkOrder[nextChunk++] * chunkRows;
+        chunkRowsLoaded = min<size_t>(chunkRows, header.rowCount - first);
+        chunkPosition = 0;
+        file.clear();
+        file.seekg(sizeof(BinaryDatasetHeader) + first * recordSize);
+        if(!file.read(chunk.data(), chunkRowsLoaded * recordSize)) {
+            throw runtime_error("Truncated binary dataset");
+        }
+        return true;
+    }
+
+    // Appends the next record of the current chunk to the shuffle buffer.
+    bool readRecord() {
+        if(chunkPosition == chunkRowsLoaded && !loadNextChunk()) {
+            return false;
+        }
+        const char *record = chunk.data() + chunkPosition++ * recordSize;
+        size_t offset = bufferFeatures.size();
+        bufferFeatures.resize(offset + header.featureCount);
+        memcpy(bufferFeatures.data() + offset, record, header.featureCount * sizeof(float));
+        uint16_t label;
+        memcpy(&label, record + header.featureCount * sizeof(float), sizeof(label));
+        if(label >= header.classCount) {
+            throw runtime_error("Label " + to_string(label) + " out of range for " + to_string(header.classCount) + " classes");
+        }
+        bufferLabels.push_back(label);
+        return true;
+    }
+};
+
+// Per-feature standardization fitted with Welford's single-pass mean/variance update.
+// Partial statistics over disjoint slices of the data merge exactly, so fitting can be
+// split across threads, and the fitted parameters travel with the model.
+struct Normalizer {
+    uint64_t count = 0;
+    vector<double> mean;
+    vector<double> m2;
+    vector<double> inverseStd;
+
+    void update(span<const double> row) {
+        if(mean.empty()) {
+            mean.assign(row.size(), 0);
+            m2.assign(row.size(), 0);
+        }
+        ++count;
+        for(size_t j=0; j<row.size(); ++j) {
+            double delta = row[j] - mean[j];
+            mean[j] += delta / count;
+            m2[j] += delta * (row[j] - mean[j]);
+        }
+    }
+
+    void merge(const Normalizer &other) {
+        if(other.count == 0) {
+            return;
+        }
+        if(count == 0) {
+            *this = other;
+            return;
+        }
+        double total = static_cast<double>(count + other.count);
+        for(size_t j=0; j<mean.size(); ++j) {
+            double delta = other.mean[j] - mean[j];
+            mean[j] += delta * other.count / total;
+            m2[j] += other.m2[j] + delta * delta * count * other.count / total;
+        }
+        count += other.count;
+    }
+
+    // Freezes the statistics into the transform; constant features are only centered.
+    void finalize() {
+        inverseStd.resize(mean.size());
+        for(size_t j=0; j<mean.size(); ++j) {
+            double stdDev = count > 0 ? sqrt(m2[j] / count) : 0;
+            inverseStd[j] = stdDev > 0 ? 1 / stdDev : 1;
+        }
+    }
+
+    bool fitted() const {
+        return !inverseStd.empty();
+    }
+
+    void transform(span<const double> input, vector<double> &output) const {
+        output.resize(input.size());
+        for(size_t j=0; j<input.size(); ++j) {
+            output[j] = (input[j] - mean[j]) * inverseStd[j];
+        }
+    }
+};
+
+Normalizer fitNormalizer(const DatasetView &inputs, unsigned threadCount = thread::hardware_concurrency()) {
+    threadCount = static_cast<unsigned>(clamp<size_t>(threadCount, 1, max<size_t>(inputs.size() / 1024, 1)));
+    vector<Normalizer> partials(threadCount);
+    vector<thread> threads;
+    for(unsigned t=0; t<threadCount; ++t) {
+        threads.emplace_back([&, t]() {
+            size_t begin = inputs.size() * t / threadCount;
+            size_t end = inputs.size() * (t + 1) / threadCount;
+            for(size_t i=begin; i<end; ++i) {
+                partials[t].update(inputs.row(i));
+            }
+        });
+    }
+    for(thread &worker: threads) {
+        worker.join();
+    }
+
+    Normalizer normalizer;
+    for(const Normalizer &partial: partials) {
+        normalizer.merge(partial);
+    }
+    normalizer.finalize();
+    return normalizer;
+}
+
+// Draws classes from the log-uniform (Zipfian) distribution P(k) = log((k + 2) / (k + 1)) / log(n + 1),
+// which suits class ids sorted by decreasing frequency.
+struct LogUniformSampler {
+    size_t classCount;
+    double logRange;
+
+    explicit LogUniformSampler(size_t classCount) : classCount(classCount), logRange(log(classCount + 1.0)) {}
+
+    size_t sample(mt19937 &gen) const {
+        double u = uniform_real_distribution<>(0, 1)(gen);
+        return min(static_cast<size_t>(exp(u * logRange)) - 1, classCount - 1);
+    }
+
+    double probability(size_t k) const {
+        return log((k + 2.0) / (k + 1.0)) / logRange;
+    }
+
+    // Expected number of times k shows up in `draws` samples with replacement.
+    double expectedCount(size_t k, size_t draws) const {
+        return -expm1(draws * log1p(-probability(k)));
+    }
+};
+
+// Learning rate per epoch: an optional linear warmup to the base rate, then constant,
+// step decay by `gamma` every `stepEpochs`, or cosine annealing down to `minRate`.
+struct LearningRateSchedule {
+    enum Type { Constant, Step, Cosine };
+    Type type = Constant;
+    int warmupEpochs = 0;
+    int stepEpochs = 30;
+    double gamma = 0.1;
+    double minRate = 0;
+
+    double rate(double baseRate, int epoch, int totalEpochs) const {
+        if(epoch < warmupEpochs) {
+            return baseRate * (epoch + 1) / warmupEpochs;
+        }
+        int decayEpoch = epoch - warmupEpochs;
+        int decayEpochs = max(totalEpochs - warmupEpochs, 1);
+        switch(type) {
+            case Step:
+                return baseRate * pow(gamma, decayEpoch / max(stepEpochs, 1));
+            case Cosine:
+                return minRate + (baseRate - minRate) * 0.5 * (1 + cos(numbers::pi * decayEpoch / decayEpochs));
+            default:
+                return baseRate;
+        }
+    }
+};
+
+struct TrainingState;
+
+// Early stopping is enabled by setting `validation` and a non-zero `patience`: training ends once
+// validation loss has not improved by more than `minDelta` for `patience` epochs.
+// sampledSoftmaxClasses > 0 trains the output layer with sampled softmax: each step scores the true
+// class and that many log-uniform negatives instead of every class. Evaluation always uses the full softmax.
+// Rows are visited in view order unless `shuffle` is set, in which case each epoch draws a new
+// order from a generator seeded with `seed`. onCheckpoint, if set, receives the training state
+// every checkpointEverySteps samples.
+struct TrainingOptions {
+    int epochs = 100;
+    size_t batchSize = 1;
+    size_t sampledSoftmaxClasses = 0;
+    bool shuffle = false;
+    unsigned seed = random_device{}();
+    size_t checkpointEverySteps = 0;
+    function<void(const TrainingState &)> onCheckpoint;
+    LearningRateSchedule schedule;
+    const DatasetView *validation = nullptr;
+    int patience = 0;
+    double minDelta = 0;
+    bool restoreBestWeights = true;
+};
+
+struct DistillationOptions {
+    int epochs = 100;
+    size_t batchSize = 8;
+    double temperature = 4;
+    double alpha = 0.9;
+    unsigned seed = random_device{}();
+};
+
+struct TrainingReport {
+    int epochsRun = 0;
+    int bestEpoch = -1;
+    double bestValidationLoss = numeric_limits<double>::infinity();
+    bool stoppedEarly = false;
+};
+
+// Everything train() needs to continue exactly where it left off: the position within the current
+// epoch and that epoch's row order, the generator behind shuffling and sampling, and the early
+// stopping bookkeeping.
+struct TrainingState {
+    int epoch = 0;
+    size_t position = 0;
+    size_t step = 0;
+    double baseRate = 0;
+    mt19937 gen;
+    vector<uint32_t> order;
+    TrainingReport report;
+    vector<Layer> bestLayers;
 };
 
+// Counts from one evaluation pass. confusion[actual * classCount + predicted]; partial reports
+// from disjoint rows merge by addition.
+struct EvaluationReport {
+    size_t classCount = 0;
+    size_t samples = 0;
+    size_t correct = 0;
+    double logLossSum = 0;
+    vector<uint64_t> confusion;
+
+    explicit EvaluationReport(size_t classCount = 0) : classCount(classCount), confusion(classCount * classCount) {}
+
+    void add(int actual, int predicted, double probabilityOfActual) {
+        ++samples;
+        correct += actual == predicted;
+        logLossSum -= log(max(probabilityOfActual, 1e-12));
+        ++confusion[actual * classCount + predicted];
+    }
+
+    void reset() {
+        samples = 0;
+        correct = 0;
+        logLossSum = 0;
+        fill(confusion.begin(), confusion.end(), 0);
+    }
+
+    void merge(const EvaluationReport &other) {
+        samples += other.samples;
+        correct += other.correct;
+        logLossSum += other.logLossSum;
+        for(size_t k=0; k<confusion.size(); ++k) {
+            confusion[k] += other.confusion[k];
+        }
+    }
+
+    double accuracy() const {
+        return static_cast<double>(correct) / max<size_t>(samples, 1);
+    }
+
+    double logLoss() const {
+        return logLossSum / max<size_t>(samples, 1);
+    }
+
+    // Of the rows predicted as c, the fraction that are c (0 if c was never predicted).
+    double precision(size_t c) const {
+        uint64_t predicted = 0;
+        for(size_t actual=0; actual<classCount; ++actual) {
+            predicted += confusion[actual * classCount + c];
+        }
+        return predicted ? static_cast<double>(confusion[c * classCount + c]) / predicted : 0;
+    }
+
+    // Of the rows labelled c, the fraction predicted as c (0 if c never occurs).
+    double recall(size_t c) const {
+        uint64_t actual = accumulate(confusion.begin() + c * classCount, confusion.begin() + (c + 1) * classCount, uint64_t(0));
+        return actual ? static_cast<double>(confusion[c * classCount + c]) / actual : 0;
+    }
+
+    void print(ostream &out) const {
+        out << "Accuracy: " << 100 * accuracy() << "%, log-loss: " << logLoss() << endl;
+        out << "Confusion matrix (rows: actual, columns: predicted):" << endl;
+        for(size_t actual=0; actual<classCount; ++actual) {
+            for(size_t predicted=0; predicted<classCount; ++predicted) {
+                out << (predicted ? "\t" : "") << confusion[actual * classCount + predicted];
+            }
+            out << endl;
+        }
+        for(size_t c=0; c<classCount; ++c) {
+            out << "Class " << c << ": precision " << precision(c) << ", recall " << recall(c) << endl;
+        }
+    }
+};
+
+class NeuralNetwork {
+public:
+    vector<Layer> layers;
+    double learningRate;
+    Normalizer normalizer;
+    Workspace workspace;
+    bool checkpointing = false;
+    size_t checkpointInterval = 0;
+    vector<size_t> checkpointBoundaries;
+
+    // Hidden layers use hiddenActivation; the output layer produces logits that go through softmax.
+    NeuralNetwork(const vector<int> &layerSizes, double learningRate, Activation hiddenActivation = Activation::ReLU)
+        : learningRate(learningRate) {
+        for(size_t i=1; i<layerSizes.size(); ++i) {
+            layers.emplace_back(layerSizes[i], layerSizes[i-1],
+                i == layerSizes.size() - 1 ? Activation::Identity : hiddenActivation);
+        }
+    }
+
+    size_t inputSize() const {
+        return layers.front().inputSize;
+    }
+
+    size_t outputSize() const {
+        return layers.back().outputSize;
+    }
+
+    vector<int> layerSizes() const {
+        vector<int> sizes{static_cast<int>(inputSize())};
+        for(const Layer &layer: layers) {
+            sizes.push_back(static_cast<int>(layer.outputSize));
+        }
+        return sizes;
+    }
+
+    MemoryPlanOptions memoryPlanOptions(const TrainingOptions &options, size_t rows) const {
+        MemoryPlanOptions planOptions;
+        planOptions.checkpointInterval = checkpointInterval;
+        planOptions.bfloat16Weights = !layers.front().packedWeights.empty();
+        planOptions.sampledSoftmaxClasses = options.sampledSoftmaxClasses < outputSize() && layers.size() > 1 ? options.sampledSoftmaxClasses : 0;
+        planOptions.keepBestWeights = options.validation && options.patience > 0 && options.restoreBestWeights;
+        planOptions.rows = rows;
+        planOptions.validationBatch = options.validation && options.patience > 0 ? inferenceBatch : 0;
+        planOptions.checkpointBytes = options.onCheckpoint && options.checkpointEverySteps ? checkpointBytes(rows, planOptions.keepBestWeights) : 0;
+        return planOptions;
+    }
+
+    // Allocates every workspace buffer of `plan` up front, at exactly its planned size, so that a
+    // configuration that does not fit fails here rather than partway through training.
+    void reserveWorkspace(Workspace &workspace, const MemoryPlan &plan) const {
+        auto reserved = [](size_t size) {
+            vector<double> buffer;
+            buffer.reserve(size);
+            return buffer;
+        };
+        workspace.activations.clear();
+        for(size_t size: plan.boundarySizes) {
+            workspace.activations.push_back(reserved(size));
+        }
+        workspace.pool.clear();
+        for(size_t i=0; i<plan.poolCount; ++i) {
+            workspace.pool.push_back(reserved(plan.poolSize));
+        }
+        workspace.deltas = reserved(plan.deltaSize);
+        workspace.previousDeltas = reserved(plan.deltaSize);
+        workspace.sampledLogits = reserved(plan.sampledLogitSize);
+        workspace.targets = reserved(plan.targetSize);
+        workspace.topK = vector<pair<double, int>>();
+        workspace.topK.reserve(plan.topKSize);
+        workspace.inputScratch = vector<float>();
+        workspace.inputScratch.reserve(plan.scratchSize);
+        workspace.sampledClasses = vector<size_t>();
+        workspace.sampledClasses.reserve(plan.sampledClassCount);
+        workspace.gradients.clear();
+        for(size_t size: plan.gradientSizes) {
+            workspace.gradients.push_back(reserved(size));
+        }
+    }
+
+    // Switches inference to bfloat16 weights, halving weight traffic compared to float32 and
+    // quartering it compared to double. Training keeps updating the double master weights and
+    // repacks each layer after its update.
+    void useBFloat16Weights(bool enabled) {
+        for(Layer &layer: layers) {
+            if(enabled) {
+                layer.packWeights();
+            }
+            else {
+                layer.packedWeights.clear();
+            }
+        }
+    }
+
+    size_t weightBytes() const {
+        size_t bytes = 0;
+        for(const Layer &layer: layers) {
+            bytes += layer.packedWeights.empty() ? layer.weights.size() * sizeof(double) : layer.packedWeights.size() * sizeof(uint16_t);
+        }
+        return bytes;
+    }
+
+    // Model file: magic, version, the layer sizes starting with the input size, one activation
+    // code per layer, the normalizer parameters, then each layer's row-major weights and biases.
+    void save(const string &filename) const {
+        ofstream file(filename, ios::binary);
+        if(!file) {
+            throw runtime_error("Cannot write model: " + filename);
+        }
+        save(file);
+    }
+
+    void save(ostream &file) const {
+        auto write = [&](const auto &value) { file.write(reinterpret_cast<const char *>(&value), sizeof(value)); };
+        file.write("NNMD", 4);
+        write(uint32_t(2));
+        write(uint32_t(layers.size() + 1));
+        write(uint32_t(inputSize()));
+        for(const Layer &layer: layers) {
+            write(uint32_t(layer.outputSize));
+        }
+        for(const Layer &layer: layers) {
+            write(layer.activation);
+        }
+        write(uint8_t(normalizer.fitted()));
+        if(normalizer.fitted()) {
+            file.write(reinterpret_cast<const char *>(normalizer.mean.data()), normalizer.mean.size() * sizeof(double));
+            file.write(reinterpret_cast<const char *>(normalizer.inverseStd.data()), normalizer.inverseStd.size() * sizeof(double));
+        }
+        for(const Layer &layer: layers) {
+            file.write(reinterpret_cast<const char *>(layer.weights.data()), layer.weights.size() * sizeof(double));
+            file.write(reinterpret_cast<const char *>(layer.biases.data()), layer.biases.size() * sizeof(double));
+        }
+    }
+
+    // Bytes written by save(ostream &).
+    size_t savedBytes() const {
+        size_t bytes = 4 + 3 * sizeof(uint32_t) + layers.size() * (sizeof(uint32_t) + sizeof(Activation)) + 1;
+        if(normalizer.fitted()) {
+            bytes += 2 * inputSize() * sizeof(double);
+        }
+        for(const Layer &layer: layers) {
+            bytes += (layer.weights.size() + layer.biases.size()) * sizeof(double);
+        }
+        return bytes;
+    }
+
+    // Longest text an mt19937 prints: its state words and position, up to 10 digits and a separator each.
+    static constexpr size_t generatorTextBytes = (mt19937::state_size + 1) * 11;
+
+    // Upper bound on the bytes saveCheckpoint writes for this model and `rows` training rows.
+    size_t checkpointBytes(size_t rows, bool bestWeights) const {
+        size_t bytes = 4 + sizeof(uint32_t) + savedBytes() + sizeof(int32_t) + 4 * sizeof(uint64_t) + generatorTextBytes +
+            sizeof(uint64_t) + rows * sizeof(uint32_t) + 2 * sizeof(int32_t) + sizeof(double) + 1;
+        if(bestWeights) {
+            for(const Layer &layer: layers) {
+                bytes += (layer.weights.size() + layer.biases.size()) * sizeof(double);
+            }
+        }
+        return bytes;
+    }
+
+    // Also reads version 1 files, which predate per-layer activations (ReLU hidden layers).
+    static NeuralNetwork load(const string &filename, double learningRate = 0.01) {
+        ifstream file(filename, ios::binary);
+        return load(file, filename, learningRate);
+    }
+
+    static NeuralNetwork load(istream &file, const string &filename, double learningRate = 0.01) {
+        char magic[4];
+        uint32_t version = 0, sizeCount = 0;
+        auto read = [&](auto &value) { file.read(reinterpret_cast<char *>(&value), sizeof(value)); };
+        file.read(magic, 4);
+        read(version);
+        read(sizeCount);
+        if(!file || memcmp(magic, "NNMD", 4) != 0 || version < 1 || version > 2 || sizeCount < 2) {
+            throw runtime_error("Not a model file: " + filename);
+        }
+        vector<int> layerSizes(sizeCount);
+        for(int &size: layerSizes) {
+            uint32_t value;
+            read(value);
+            size = value;
+        }
+
+        NeuralNetwork nn(layerSizes, learningRate);
+        if(version >= 2) {
+            for(Layer &layer: nn.layers) {
+                read(layer.activation);
+                if(file && static_cast<uint8_t>(layer.activation) > static_cast<uint8_t>(Activation::Identity)) {
+                    throw runtime_error("Unsupported activation in model file: " + filename);
+                }
+            }
+        }
+        uint8_t hasNormalizer = 0;
+        read(hasNormalizer);
+        if(hasNormalizer) {
+            nn.normalizer.mean.resize(layerSizes[0]);
+            nn.normalizer.inverseStd.resize(layerSizes[0]);
+            file.read(reinterpret_cast<char *>(nn.normalizer.mean.data()), layerSizes[0] * sizeof(double));
+            file.read(reinterpret_cast<char *>(nn.normalizer.inverseStd.data()), layerSizes[0] * sizeof(double));
+        }
+        for(Layer &layer: nn.layers) {
+            file.read(reinterpret_cast<char *>(layer.weights.data()), layer.weights.size() * sizeof(double));
+            file.read(reinterpret_cast<char *>(layer.biases.data()), layer.biases.size() * sizeof(double));
+        }
+        if(!file) {
+            throw runtime_error("Truncated model file: " + filename);
+        }
+        return nn;
+    }
+
+    // Runs `batch` contiguous input rows through the network; the softmax probabilities end up in
+    // workspace.activations.back(). Does not modify the network, so each thread can bring its own workspace.
+    void forward(const double *inputs, size_t batch, Workspace &workspace) const {
+        forwardLogits(inputs, batch, workspace);
+        double *output = workspace.activations.back().data();
+        for(size_t b=0; b<batch; ++b) {
+            softmax(output + b * outputSize(), outputSize());
+        }
+    }
+
+    // Like forward() but leaves the output layer's logits, before softmax, in workspace.activations.back().
+    void forwardLogits(const double *inputs, size_t batch, Workspace &workspace) const {
+        forwardHidden(inputs, batch, workspace);
+        size_t last = layers.size() - 1;
+        double *output = workspace.acquire(last + 1, batch * outputSize());
+        layers[last].forward(workspace.activations[last].data(), output, batch, workspace.inputScratch);
+        if(!keepsActivation(last)) {
+            workspace.release(last);
+        }
+    }
+
+    // Softmax of logits / temperature; temperatures above 1 soften the distribution and expose how
+    // the model ranks the wrong classes.
+    void softenedForward(const double *inputs, size_t batch, double temperature, Workspace &workspace) const {
+        forwardLogits(inputs, batch, workspace);
+        double *output = workspace.activations.back().data();
+        for(size_t k=0; k<batch * outputSize(); ++k) {
+            output[k] /= temperature;
+        }
+        for(size_t b=0; b<batch; ++b) {
+            softmax(output + b * outputSize(), outputSize());
+        }
+    }
+
+    // One distillation step (Hinton et al.): the loss is alpha * T^2 * cross-entropy against the
+    // teacher's softened probabilities at temperature T plus (1 - alpha) * cross-entropy against
+    // the hard labels. The T^2 factor keeps the soft term's gradient scale independent of T.
+    void distillStep(const double *inputs, const double *softTargets, const int *labels, size_t batch,
+        double temperature, double alpha, Workspace &workspace) {
+        forwardLogits(inputs, batch, workspace);
+        const double *logits = workspace.activations.back().data();
+        vector<double> &soft = workspace.targets;
+        soft.resize(outputSize());
+        workspace.deltas.resize(batch * outputSize());
+        for(size_t b=0; b<batch; ++b) {
+            const double *z = logits + b * outputSize();
+            double *delta = workspace.deltas.data() + b * outputSize();
+            for(size_t k=0; k<outputSize(); ++k) {
+                soft[k] = z[k] / temperature;
+                delta[k] = z[k];
+            }
+            softmax(soft.data(), outputSize());
+            softmax(delta, outputSize());
+            for(size_t k=0; k<outputSize(); ++k) {
+                double hard = delta[k] - (static_cast<int>(k) == labels[b]);
+                delta[k] = alpha * temperature * (soft[k] - softTargets[b * outputSize() + k]) + (1 - alpha) * hard;
+            }
+        }
+        backpropagate(layers.size(), workspace);
+    }
+
+    // Runs the batch through every layer except the output layer, whose input is left in
+    // workspace.activations[layers.size() - 1].
+    void forwardHidden(const double *inputs, size_t batch, Workspace &workspace) const {
+        workspace.batch = batch;
+        workspace.activations.resize(layers.size() + 1);
+        double *input = workspace.acquire(0, batch * inputSize());
+        if(normalizer.fitted()) {
+            for(size_t b=0; b<batch; ++b) {
+                for(size_t j=0; j<inputSize(); ++j) {
+                    size_t k = b * inputSize() + j;
+                    input[k] = (inputs[k] - normalizer.mean[j]) * normalizer.inverseStd[j];
+                }
+            }
+        }
+        else {
+            copy_n(inputs, batch * inputSize(), input);
+        }
+
+        for(size_t l=0; l+1<layers.size(); ++l) {
+            double *layerOutput = workspace.acquire(l + 1, batch * layers[l].outputSize, !keepsActivation(l + 1));
+            layers[l].forward(workspace.activations[l].data(), layerOutput, batch, workspace.inputScratch);
+            if(!keepsActivation(l)) {
+                workspace.release(l);
+            }
+        }
+    }
+
+    // Backpropagates softmax cross-entropy for the batch last passed to forward() and applies one
+    // SGD step with the gradient averaged over the batch. If inputGradient is given, it receives
+    // the gradient of the batch-mean loss with respect to the raw inputs, for a layer in front of
+    // the network such as an embedding table.
+    void backward(const int *labels, Workspace &workspace, double *inputGradient = nullptr) {
+        outputDeltas(labels, workspace);
+        backpropagate(layers.size(), workspace, inputGradient);
+    }
+
+    void outputDeltas(const int *labels, Workspace &workspace) const {
+        const vector<double> &output = workspace.activations.back();
+        workspace.deltas.assign(output.begin(), output.end());
+        for(size_t b=0; b<workspace.batch; ++b) {
+            workspace.deltas[b * outputSize() + labels[b]] -= 1;
+        }
+    }
+
+    // Turns workspace.deltas for layer l into workspace.previousDeltas for layer l - 1.
+    void propagateDeltas(size_t l, Workspace &workspace) const {
+        const Layer &layer = layers[l];
+        size_t batch = workspace.batch;
+        const double *previous = workspace.activations[l].data();
+        const double *delta = workspace.deltas.data();
+        workspace.previousDeltas.assign(batch * layer.inputSize, 0);
+        for(size_t b=0; b<batch; ++b) {
+            double *previousDelta = workspace.previousDeltas.data() + b * layer.inputSize;
+            for(size_t o=0; o<layer.outputSize; ++o) {
+                double d = delta[b * layer.outputSize + o];
+                const double *w = layer.weights.data() + o * layer.inputSize;
+                for(size_t i=0; i<layer.inputSize; ++i) {
+                    previousDelta[i] += w[i] * d;
+                }
+            }
+        }
+        withActivation(layers[l - 1].activation, [&](auto policy) {
+            for(size_t k=0; k<batch * layer.inputSize; ++k) {
+                workspace.previousDeltas[k] *= decltype(policy)::derivative(previous[k]);
+            }
+        });
+    }
+
+    // Computes the batch gradient summed over examples into workspace.gradients without touching
+    // the weights. Each layer's buffer holds its row-major weight gradient followed by its bias
+    // gradient. layerReady(l) is called as soon as layer l is finished, top layer first, so the
+    // caller can start communicating it while the layers below are still being computed.
+    void computeGradients(const double *inputs, const int *labels, size_t batch, Workspace &workspace,
+        const function<void(size_t)> &layerReady) const {
+        forward(inputs, batch, workspace);
+        outputDeltas(labels, workspace);
+        workspace.gradients.resize(layers.size());
+        for(size_t l=layers.size(); l-- > 0;) {
+            const Layer &layer = layers[l];
+            if(workspace.activations[l].empty()) {
+                recomputeSegment(l, workspace);
+            }
+            if(l > 0) {
+                propagateDeltas(l, workspace);
+            }
+
+            vector<double> &gradient = workspace.gradients[l];
+            gradient.assign(layer.weights.size() + layer.outputSize, 0);
+            double *biasGradient = gradient.data() + layer.weights.size();
+            const double *previous = workspace.activations[l].data();
+            for(size_t b=0; b<batch; ++b) {
+                const double *x = previous + b * layer.inputSize;
+                for(size_t o=0; o<layer.outputSize; ++o) {
+                    double d = workspace.deltas[b * layer.outputSize + o];
+                    double *g = gradient.data() + o * layer.inputSize;
+                    for(size_t i=0; i<layer.inputSize; ++i) {
+                        g[i] += d * x[i];
+                    }
+                    biasGradient[o] += d;
+                }
+            }
+            if(!keepsActivation(l + 1)) {
+                workspace.release(l + 1);
+            }
+            swap(workspace.deltas, workspace.previousDeltas);
+            if(layerReady) {
+                layerReady(l);
+            }
+        }
+    }
+
+    // SGD step from workspace.gradients; scale is normally learningRate over the number of
+    // examples the gradients were summed over.
+    void applyGradients(const Workspace &workspace, double scale) {
+        for(size_t l=0; l<layers.size(); ++l) {
+            Layer &layer = layers[l];
+            const double *gradient = workspace.gradients[l].data();
+            bool packed = !layer.packedWeights.empty();
+            for(size_t o=0; o<layer.outputSize; ++o) {
+                for(size_t k=o * layer.inputSize; k<(o + 1) * layer.inputSize; ++k) {
+                    layer.weights[k] -= scale * gradient[k];
+                }
+                layer.biases[o] -= scale * gradient[layer.weights.size() + o];
+                // Refresh the bfloat16 copy of the row while it is still in cache.
+                if(packed) {
+                    layer.packRow(o);
+                }
+            }
+        }
+    }
+
+    // Applies SGD to layers [0, top) given workspace.deltas, the loss gradient with respect to the
+    // pre-activation outputs of layer top - 1.
+    void backpropagate(size_t top, Workspace &workspace, double *inputGradient = nullptr) {
+        size_t batch = workspace.batch;
+        double step = learningRate / batch;
+        for(size_t l=top; l-- > 0;) {
+            Layer &layer = layers[l];
+            if(workspace.activations[l].empty()) {
+                recomputeSegment(l, workspace);
+            }
+            const double *previous = workspace.activations[l].data();
+            const double *delta = workspace.deltas.data();
+
+            // The previous layer's deltas need this layer's weights before they are updated.
+            if(l > 0) {
+                propagateDeltas(l, workspace);
+            }
+            else if(inputGradient) {
+                fill_n(inputGradient, batch * layer.inputSize, 0.0);
+                for(size_t b=0; b<batch; ++b) {
+                    double *gradient = inputGradient + b * layer.inputSize;
+                    for(size_t o=0; o<layer.outputSize; ++o) {
+                        double d = delta[b * layer.outputSize + o] / batch;
+                        const double *w = layer.weights.data() + o * layer.inputSize;
+                        for(size_t i=0; i<layer.inputSize; ++i) {
+                            gradient[i] += w[i] * d;
+                        }
+                    }
+                    if(normalizer.fitted()) {
+                        for(size_t i=0; i<layer.inputSize; ++i) {
+                            gradient[i] *= normalizer.inverseStd[i];
+                        }
+                    }
+                }
+            }
+
+            // Row by row, so each weight row is updated by the whole batch and its bfloat16 copy
+            // refreshed while it is still in cache.
+            bool packed = !layer.packedWeights.empty();
+            for(size_t o=0; o<layer.outputSize; ++o) {
+                double *w = layer.weights.data() + o * layer.inputSize;
+                for(size_t b=0; b<batch; ++b) {
+                    const double *x = previous + b * layer.inputSize;
+                    double d = step * delta[b * layer.outputSize + o];
+                    for(size_t i=0; i<layer.inputSize; ++i) {
+                        w[i] -= d * x[i];
+                    }
+                    layer.biases[o] -= d;
+                }
+                if(packed) {
+                    layer.packRow(o);
+                }
+            }
+            if(!keepsActivation(l + 1)) {
+                workspace.release(l + 1);
+            }
+            swap(workspace.deltas, workspace.previousDeltas);
+        }
+    }
+
+    // One sampled-softmax training step. Every example scores its true class plus `sampleCount`
+    // negatives drawn once per batch; logits are corrected by the log expected count of each class
+    // and sampled classes equal to an example's own label are masked out. Only the scored rows of
+    // the output layer are read and updated, so the cost scales with the sample size rather than
+    // the class count.
+    void sampledSoftmaxStep(const double *inputs, const int *labels, size_t batch, size_t sampleCount,
+        const LogUniformSampler &sampler, mt19937 &gen, Workspace &workspace) {
+        forwardHidden(inputs, batch, workspace);
+        Layer &output = layers.back();
+        const double *hidden = workspace.activations[layers.size() - 1].data();
+
+        vector<size_t> &candidates = workspace.sampledClasses;
+        candidates.clear();
+        for(size_t i=0; i<sampleCount; ++i) {
+            candidates.push_back(sampler.sample(gen));
+        }
+        sort(candidates.begin(), candidates.end());
+        candidates.erase(unique(candidates.begin(), candidates.end()), candidates.end());
+
+        // Per example: slot 0 is the true class, slots 1.. are the shared candidates.
+        size_t width = candidates.size() + 1;
+        vector<double> &logits = workspace.sampledLogits;
+        logits.resize(batch * width);
+        for(size_t b=0; b<batch; ++b) {
+            const double *h = hidden + b * output.inputSize;
+            double *row = logits.data() + b * width;
+            for(size_t c=0; c<width; ++c) {
+                size_t k = c == 0 ? labels[b] : candidates[c - 1];
+                if(c > 0 && k == static_cast<size_t>(labels[b])) {
+                    row[c] = -numeric_limits<double>::infinity();
+                    continue;
+                }
+                double logit = dot(output.weights.data() + k * output.inputSize, h, output.inputSize) + output.biases[k];
+                row[c] = logit - log(sampler.expectedCount(k, sampleCount));
+            }
+            softmax(row, width);
+            row[0] -= 1;
+        }
+
+        // Deltas for the hidden layer use the output rows before they are updated.
+        workspace.deltas.assign(batch * output.inputSize, 0);
+        for(size_t b=0; b<batch; ++b) {
+            double *delta = workspace.deltas.data() + b * output.inputSize;
+            for(size_t c=0; c<width; ++c) {
+                size_t k = c == 0 ? labels[b] : candidates[c - 1];
+                double d = logits[b * width + c];
+                const double *w = output.weights.data() + k * output.inputSize;
+                for(size_t i=0; i<output.inputSize; ++i) {
+                    delta[i] += w[i] * d;
+                }
+            }
+        }
+        withActivation(layers[layers.size() - 2].activation, [&](auto policy) {
+            for(size_t k=0; k<workspace.deltas.size(); ++k) {
+                workspace.deltas[k] *= decltype(policy)::derivative(hidden[k]);
+            }
+        });
+
+        double step = learningRate / batch;
+        for(size_t b=0; b<batch; ++b) {
+            const double *h = hidden + b * output.inputSize;
+            for(size_t c=0; c<width; ++c) {
+                size_t k = c == 0 ? labels[b] : candidates[c - 1];
+                double d = step * logits[b * width + c];
+                double *w = output.weights.data() + k * output.inputSize;
+                for(size_t i=0; i<output.inputSize; ++i) {
+                    w[i] -= d * h[i];
+                }
+                output.biases[k] -= d;
+                if(!output.packedWeights.empty()) {
+                    output.packRow(k);
+                }
+            }
+        }
+        backpropagate(layers.size() - 1, workspace);
+    }
+
+    // Keeps forward activations only at every `interval`-th layer boundary (0 keeps all of them).
+    // backward() then recomputes each segment between kept boundaries from its checkpoint, trading
+    // one extra forward pass for activation memory that grows with depth / interval + interval.
+    void checkpointActivations(size_t interval) {
+        checkpointBoundaries.clear();
+        for(size_t boundary=interval; interval > 0 && boundary < layers.size(); boundary += interval) {
+            checkpointBoundaries.push_back(boundary);
+        }
+        checkpointing = interval > 0;
+        checkpointInterval = interval;
+    }
+
+    bool keepsActivation(size_t boundary) const {
+        return !checkpointing || boundary == 0 || boundary == layers.size() ||
+            binary_search(checkpointBoundaries.begin(), checkpointBoundaries.end(), boundary);
+    }
+
+    // Refills the activations of the segment that ends at `boundary`, starting from the nearest kept boundary below it.
+    void recomputeSegment(size_t boundary, Workspace &workspace) const {
+        size_t start = boundary;
+        while(workspace.activations[start].empty()) {
+            --start;
+        }
+        for(size_t l=start; l<boundary; ++l) {
+            double *layerOutput = workspace.acquire(l + 1, workspace.batch * layers[l].outputSize, !keepsActivation(l + 1));
+            layers[l].forward(workspace.activations[l].data(), layerOutput, workspace.batch, workspace.inputScratch);
+        }
+    }
+
+    void forwardPropagation(span<const double> inputValues) {
+        forward(inputValues.data(), 1, workspace);
+    }
+
+    void backProgpagation(int targetClass) {
+        backward(&targetClass, workspace);
+    }
+
+    // Softmax output of the last forwardPropagation call.
+    span<const double> output() const {
+        return {workspace.activations.back().data(), outputSize()};
+    }
+
+    // Trains this network as the student of `teacher`, which must have the same input and output
+    // sizes. Teacher targets are computed batch by batch, so nothing dataset-sized is held.
+    void distill(const NeuralNetwork &teacher, const DatasetView &data, const DistillationOptions &options) {
+        if(teacher.inputSize() != inputSize() || teacher.outputSize() != outputSize()) {
+            throw runtime_error("Teacher and student must have the same input and output sizes");
+        }
+        size_t batchSize = max<size_t>(options.batchSize, 1);
+        MemoryPlanOptions planOptions;
+        planOptions.checkpointInterval = checkpointInterval;
+        planOptions.bfloat16Weights = !layers.front().packedWeights.empty();
+        planOptions.distillation = true;
+        reserveWorkspace(workspace, planMemory(layerSizes(), batchSize, planOptions));
+        MemoryPlanOptions teacherOptions;
+        teacherOptions.checkpointInterval = teacher.checkpointInterval;
+        teacherOptions.bfloat16Weights = !teacher.layers.front().packedWeights.empty();
+        Workspace teacherWorkspace;
+        teacher.reserveWorkspace(teacherWorkspace, planMemory(teacher.layerSizes(), batchSize, inferencePlanOptions(teacherOptions)));
+        vector<double> batchInputs(batchSize * inputSize());
+        vector<int> batchLabels(batchSize);
+        vector<uint32_t> order(data.size());
+        iota(order.begin(), order.end(), 0);
+        mt19937 gen(options.seed);
+        for(int epoch=0; epoch<options.epochs; ++epoch) {
+            shuffle(order.begin(), order.end(), gen);
+            for(size_t first=0; first<data.size(); first+=batchSize) {
+                size_t batch = min(batchSize, data.size() - first);
+                for(size_t b=0; b<batch; ++b) {
+                    copy_n(data.row(order[first + b]).data(), inputSize(), batchInputs.data() + b * inputSize());
+                    batchLabels[b] = data.label(order[first + b]);
+                }
+                teacher.softenedForward(batchInputs.data(), batch, options.temperature, teacherWorkspace);
+                distillStep(batchInputs.data(), teacherWorkspace.activations.back().data(), batchLabels.data(), batch,
+                    options.temperature, options.alpha, workspace);
+            }
+        }
+    }
+
+    // afterStep is called with the number of samples trained so far and can stop training by returning false.
+    TrainingReport train(const DatasetView &data, const TrainingOptions &options, const function<bool(size_t)> &afterStep = nullptr) {
+        TrainingState state;
+        state.baseRate = learningRate;
+        state.gen.seed(options.seed);
+        return train(data, options, state, afterStep);
+    }
+
+    // Continues training from `state`, which is kept current at every step boundary so that a copy
+    // taken by onCheckpoint resumes with the same weights, row order and random draws.
+    TrainingReport train(const DatasetView &data, const TrainingOptions &options, TrainingState &state,
+        const function<bool(size_t)> &afterStep = nullptr) {
+        TrainingReport &report = state.report;
+        size_t batchSize = max<size_t>(options.batchSize, 1);
+        MemoryPlanOptions planOptions = memoryPlanOptions(options, data.size());
+        reserveWorkspace(workspace, planMemory(layerSizes(), batchSize, planOptions));
+        vector<double> batchInputs;
+        vector<int> batchLabels;
+        batchInputs.reserve(batchSize * inputSize());
+        batchLabels.reserve(batchSize);
+        state.order.reserve(data.size());
+        if(planOptions.keepBestWeights && state.bestLayers.empty()) {
+            state.bestLayers = layers;
+        }
+        // The per-epoch validation pass runs on this thread with buffers allocated here, once.
+        Workspace validationWorkspace;
+        vector<double> validationInputs;
+        EvaluationReport validationReport;
+        if(planOptions.validationBatch > 0) {
+            reserveWorkspace(validationWorkspace, planMemory(layerSizes(), planOptions.validationBatch, inferencePlanOptions(planOptions)));
+            validationInputs.resize(planOptions.validationBatch * inputSize());
+            validationReport = EvaluationReport(outputSize());
+        }
+        bool sampled = options.sampledSoftmaxClasses > 0 && options.sampledSoftmaxClasses < outputSize() && layers.size() > 1;
+        LogUniformSampler sampler(outputSize());
+        size_t checkpointEvery = options.onCheckpoint ? options.checkpointEverySteps : 0;
+        size_t nextCheckpoint = checkpointEvery ? (state.step / checkpointEvery + 1) * checkpointEvery : 0;
+        bool interrupted = false;
+        while(state.epoch < options.epochs && !report.stoppedEarly) {
+            if(state.position == 0) {
+                state.order.resize(data.size());
+                iota(state.order.begin(), state.order.end(), 0);
+                if(options.shuffle) {
+                    shuffle(state.order.begin(), state.order.end(), state.gen);
+                }
+            }
+            learningRate = options.schedule.rate(state.baseRate, state.epoch, options.epochs);
+            while(state.position < data.size()) {
+                size_t batch = min(batchSize, data.size() - state.position);
+                batchInputs.resize(batch * inputSize());
+                batchLabels.resize(batch);
+                for(size_t b=0; b<batch; ++b) {
+                    size_t row = state.order[state.position + b];
+                    copy_n(data.row(row).data(), inputSize(), batchInputs.data() + b * inputSize());
+                    batchLabels[b] = data.label(row);
+                }
+                if(sampled) {
+                    sampledSoftmaxStep(batchInputs.data(), batchLabels.data(), batch, options.sampledSoftmaxClasses, sampler, state.gen, workspace);
+                }
+                else {
+                    forward(batchInputs.data(), batch, workspace);
+                    backward(batchLabels.data(), workspace);
+                }
+                state.position += batch;
+                state.step += batch;
+                if(checkpointEvery && state.step >= nextCheckpoint) {
+                    options.onCheckpoint(state);
+                    nextCheckpoint = (state.step / checkpointEvery + 1) * checkpointEvery;
+                }
+                if(afterStep && !afterStep(state.step)) {
+                    interrupted = true;
+                    break;
+                }
+            }
+            report.epochsRun = state.epoch + 1;
+            if(interrupted) {
+                report.stoppedEarly = true;
+                break;
+            }
+
+            if(options.validation && options.patience > 0) {
+                validationReport.reset();
+                evaluateRows(*options.validation, 0, options.validation->size(), validationReport, validationWorkspace, validationInputs.data());
+                double loss = validationReport.logLoss();
+                if(loss < report.bestValidationLoss - options.minDelta) {
+                    report.bestValidationLoss = loss;
+                    report.bestEpoch = state.epoch;
+                    if(options.restoreBestWeights) {
+                        state.bestLayers = layers;
+                    }
+                }
+                else if(state.epoch - report.bestEpoch >= options.patience) {
+                    report.stoppedEarly = true;
+                }
+            }
+            ++state.epoch;
+            state.position = 0;
+        }
+        learningRate = state.baseRate;
+        if(!state.bestLayers.empty() && report.bestEpoch >= 0 && report.bestEpoch != report.epochsRun - 1) {
+            layers = state.bestLayers;
+        }
+        return report;
+    }
+
+    TrainingReport train(const DatasetView &data, int epochs, const function<bool(size_t)> &afterStep = nullptr) {
+        TrainingOptions options;
+        options.epochs = epochs;
+        return train(data, options, afterStep);
+    }
+
+    void trainStreaming(DatasetStream &stream, int epochs) {
+        if(stream.header.classCount != outputSize()) {
+            throw runtime_error("Dataset class count does not match the output layer");
+        }
+        if(stream.header.featureCount != inputSize()) {
+            throw runtime_error("Dataset feature count does not match the input layer");
+        }
+        vector<double> input;
+        int label;
+        for(int i=0; i<epochs; ++i) {
+            stream.beginEpoch();
+            while(stream.next(input, label)) {
+                forwardPropagation(input);
+                backProgpagation(label);
+            }
+        }
+    }
+
+    int predict(span<const double> input) {
+        forwardPropagation(input);
+        span<const double> probabilities = output();
+        return distance(probabilities.begin(), max_element(probabilities.begin(), probabilities.end()));
+    }
+
+    // Largest batch the batched inference entry points push through forward() at once.
+    static constexpr size_t inferenceBatch = 64;
+
+    // Writes the argmax class of each of `count` contiguous input rows to classIds.
+    void predictBatch(const double *inputs, size_t count, int *classIds, Workspace &workspace) const {
+        for(size_t first=0; first<count; first+=inferenceBatch) {
+            size_t batch = min(inferenceBatch, count - first);
+            forward(inputs + first * inputSize(), batch, workspace);
+            for(size_t b=0; b<batch; ++b) {
+                const double *probabilities = workspace.activations.back().data() + b * outputSize();
+                classIds[first + b] = static_cast<int>(max_element(probabilities, probabilities + outputSize()) - probabilities);
+            }
+        }
+    }
+
+    void predictBatch(const double *inputs, size_t count, int *classIds) {
+        predictBatch(inputs, count, classIds, workspace);
+    }
+
+    // Writes the k most probable classes of each of `count` contiguous input rows, best first, to
+    // classIds[row * k ...] and their probabilities to probabilities[row * k ...]. Selection keeps a
+    // k-element min-heap per row, so it costs O(classes * log k) instead of a full sort. When k
+    // exceeds the class count, the slots past it get class -1 and probability 0.
+    void predictTopK(const double *inputs, size_t count, size_t k, int *classIds, double *probabilities, Workspace &workspace) const {
+        if(k == 0) {
+            return;
+        }
+        size_t kept = min(k, outputSize());
+        auto greaterFirst = [](const pair<double, int> &a, const pair<double, int> &b) { return a.first > b.first; };
+        for(size_t first=0; first<count; first+=inferenceBatch) {
+            size_t batch = min(inferenceBatch, count - first);
+            forward(inputs + first * inputSize(), batch, workspace);
+            for(size_t b=0; b<batch; ++b) {
+                const double *output = workspace.activations.back().data() + b * outputSize();
+                vector<pair<double, int>> &heap = workspace.topK;
+                heap.clear();
+                for(size_t c=0; c<outputSize(); ++c) {
+                    if(heap.size() < kept) {
+                        heap.emplace_back(output[c], static_cast<int>(c));
+                        push_heap(heap.begin(), heap.end(), greaterFirst);
+                    }
+                    else if(output[c] > heap.front().first) {
+                        pop_heap(heap.begin(), heap.end(), greaterFirst);
+                        heap.back() = {output[c], static_cast<int>(c)};
+                        push_heap(heap.begin(), heap.end(), greaterFirst);
+                    }
+                }
+                sort_heap(heap.begin(), heap.end(), greaterFirst);
+                for(size_t j=0; j<k; ++j) {
+                    classIds[(first + b) * k + j] = j < kept ? heap[j].second : -1;
+                    probabilities[(first + b) * k + j] = j < kept ? heap[j].first : 0;
+                }
+            }
+        }
+    }
+
+    void predictTopK(const double *inputs, size_t count, size_t k, int *classIds, double *probabilities) {
+        predictTopK(inputs, count, k, classIds, probabilities, workspace);
+    }
+
+    // Accuracy, confusion matrix and log-loss in one pass. Threads take contiguous ranges of rows
+    // and run them through the network in inference-sized batches with their own workspace and
+    // partial report; the partials are merged at the end. Small sets stay on the calling thread.
+    EvaluationReport evaluate(const DatasetView &data, unsigned threadCount = thread::hardware_concurrency()) const {
+        threadCount = static_cast<unsigned>(clamp<size_t>(threadCount, 1, max<size_t>(data.size() / (4 * inferenceBatch), 1)));
+        vector<EvaluationReport> partials(threadCount, EvaluationReport(outputSize()));
+        auto evaluateRange = [&](unsigned t) {
+            evaluateRows(data, data.size() * t / threadCount, data.size() * (t + 1) / threadCount, partials[t]);
+        };
+        vector<thread> threads;
+        for(unsigned t=1; t<threadCount; ++t) {
+            threads.emplace_back(evaluateRange, t);
+        }
+        evaluateRange(0);
+        for(thread &worker: threads) {
+            worker.join();
+        }
+        for(unsigned t=1; t<threadCount; ++t) {
+            partials[0].merge(partials[t]);
+        }
+        return partials[0];
+    }
+
+    // Adds rows [begin, end) of `data` to `report`, in inference-sized batches.
+    void evaluateRows(const DatasetView &data, size_t begin, size_t end, EvaluationReport &report) const {
+        Workspace workspace;
+        vector<double> inputs(inferenceBatch * inputSize());
+        evaluateRows(data, begin, end, report, workspace, inputs.data());
+    }
+
+    // Same, with the caller's workspace and an input buffer of inferenceBatch rows.
+    void evaluateRows(const DatasetView &data, size_t begin, size_t end, EvaluationReport &report, Workspace &workspace, double *inputs) const {
+        for(size_t first=begin; first<end; first+=inferenceBatch) {
+            size_t batch = min(inferenceBatch, end - first);
+            for(size_t b=0; b<batch; ++b) {
+                copy_n(data.row(first + b).data(), inputSize(), inputs + b * inputSize());
+            }
+            forward(inputs, batch, workspace);
+            for(size_t b=0; b<batch; ++b) {
+                const double *probabilities = workspace.activations.back().data() + b * outputSize();
+                int predicted = static_cast<int>(max_element(probabilities, probabilities + outputSize()) - probabilities);
+                int actual = data.label(first + b);
+                report.add(actual, predicted, probabilities[actual]);
+            }
+        }
+    }
+
+    double evaluateAccuracy(const DatasetView &data) const {
+        return evaluate(data).accuracy();
+    }
+
+    // Mean cross-entropy of the softmax outputs against the labels.
+    double evaluateLoss(const DatasetView &data) const {
+        return evaluate(data).logLoss();
+    }
+
+};
+
+// Lookup tables for categorical features, so high-cardinality IDs need no one-hot expansion.
+// Each feature has its own table of `dimension`-wide rows; an example may carry several IDs per
+// feature, whose rows are summed or averaged. Hashed features map arbitrary 64-bit IDs onto the
+// table, otherwise IDs index it directly. Training uses row-wise sparse Adagrad: a step touches
+// only the rows looked up in the batch and their one-scalar accumulators, so its cost does not
+// depend on the table size.
+//
+// A batch's IDs are in compressed form: the IDs of example b, feature f are
+// ids[offsets[b * featureCount + f] .. offsets[b * featureCount + f + 1]).
+class EmbeddingLayer {
+public:
+    enum class Pooling : uint8_t { Sum, Mean };
+
+    struct Feature {
+        size_t rows = 0;
+        bool hashed = false;
+        Pooling pooling = Pooling::Mean;
+    };
+
+    vector<Feature> features;
+    size_t dimension;
+    double learningRate;
+    vector<vector<double>> tables;
+    vector<vector<double>> accumulators;
+
+    EmbeddingLayer(vector<Feature> features, size_t dimension, double learningRate = 0.05, unsigned seed = random_device{}())
+        : features(move(features)), dimension(dimension), learningRate(learningRate) {
+        mt19937 gen(seed);
+        uniform_real_distribution<> dis(-0.1, 0.1);
+        for(const Feature &feature: this->features) {
+            tables.emplace_back(feature.rows * dimension);
+            generate(tables.back().begin(), tables.back().end(), [&](){ return dis(gen); });
+            accumulators.emplace_back(feature.rows, 0.0);
+        }
+    }
+
+    size_t outputSize() const {
+        return features.size() * dimension;
+    }
+
+    size_t row(size_t f, uint64_t id) const {
+        if(features[f].hashed) {
+            id ^= id >> 33;
+            id *= 0xff51afd7ed558ccdull;
+            id ^= id >> 33;
+            return id % features[f].rows;
+        }
+        if(id >= features[f].rows) {
+            throw out_of_range("Embedding id " + to_string(id) + " is outside feature " + to_string(f) + "'s table");
+        }
+        return id;
+    }
+
+    // Writes each example's pooled rows, feature after feature, to output + b * outputStride.
+    // An example without IDs for a feature gets zeros.
+    void forward(const uint64_t *ids, const uint32_t *offsets, size_t batch, double *output, size_t outputStride) const {
+        for(size_t b=0; b<batch; ++b) {
+            for(size_t f=0; f<features.size(); ++f) {
+                double *pooled = output + b * outputStride + f * dimension;
+                fill_n(pooled, dimension, 0.0);
+                uint32_t first = offsets[b * features.size() + f], last = offsets[b * features.size() + f + 1];
+                for(uint32_t k=first; k<last; ++k) {
+                    const double *embedding = tables[f].data() + row(f, ids[k]) * dimension;
+                    for(size_t d=0; d<dimension; ++d) {
+                        pooled[d] += embedding[d];
+                    }
+                }
+                if(features[f].pooling == Pooling::Mean && last - first > 1) {
+                    for(size_t d=0; d<dimension; ++d) {
+                        pooled[d] /= last - first;
+                    }
+                }
+            }
+        }
+    }
+
+    // Applies one row-wise Adagrad step given the loss gradient with respect to forward()'s
+    // output. Gradients of rows looked up more than once in the batch are summed first.
+    void backward(const uint64_t *ids, const uint32_t *offsets, size_t batch, const double *outputGradient, size_t gradientStride) {
+        for(size_t f=0; f<features.size(); ++f) {
+            touchedRows.clear();
+            rowGradients.clear();
+            for(size_t b=0; b<batch; ++b) {
+                const double *gradient = outputGradient + b * gradientStride + f * dimension;
+                uint32_t first = offsets[b * features.size() + f], last = offsets[b * features.size() + f + 1];
+                double scale = features[f].pooling == Pooling::Mean && last - first > 1 ? 1.0 / (last - first) : 1.0;
+                for(uint32_t k=first; k<last; ++k) {
+                    auto [slot, added] = touchedRows.try_emplace(row(f, ids[k]), rowGradients.size() / dimension);
+                    if(added) {
+                        rowGradients.resize(rowGradients.size() + dimension, 0.0);
+                    }
+                    double *rowGradient = rowGradients.data() + slot->second * dimension;
+                    for(size_t d=0; d<dimension; ++d) {
+                        rowGradient[d] += scale * gradient[d];
+                    }
+                }
+            }
+            for(const auto &[r, slot]: touchedRows) {
+                const double *rowGradient = rowGradients.data() + slot * dimension;
+                double squares = 0;
+                for(size_t d=0; d<dimension; ++d) {
+                    squares += rowGradient[d] * rowGradient[d];
+                }
+                double &accumulator = accumulators[f][r];
+                accumulator += squares / dimension;
+                double step = learningRate / (sqrt(accumulator) + 1e-8);
+                double *embedding = tables[f].data() + r * dimension;
+                for(size_t d=0; d<dimension; ++d) {
+                    embedding[d] -= step * rowGradient[d];
+                }
+            }
+        }
+    }
+
+private:
+    unordered_map<size_t, size_t> touchedRows;
+    vector<double> rowGradients;
+};
+
+// A network whose input row is `denseSize` numeric features followed by the pooled embeddings.
+class EmbeddingNetwork {
+public:
+    EmbeddingLayer embeddings;
+    NeuralNetwork network;
+    size_t denseSize;
+
+    // hiddenSizes lists the hidden layer widths; the input width follows from the embeddings.
+    EmbeddingNetwork(EmbeddingLayer embeddings, size_t denseSize, const vector<int> &hiddenSizes, int classCount, double learningRate)
+        : embeddings(move(embeddings)), network(layerSizes(this->embeddings, denseSize, hiddenSizes, classCount), learningRate),
+          denseSize(denseSize) {}
+
+    void trainStep(const double *dense, const uint64_t *ids, const uint32_t *offsets, const int *labels, size_t batch) {
+        assemble(dense, ids, offsets, batch);
+        inputGradient.resize(inputs.size());
+        network.forward(inputs.data(), batch, network.workspace);
+        network.backward(labels, network.workspace, inputGradient.data());
+        embeddings.backward(ids, offsets, batch, inputGradient.data() + denseSize, network.inputSize());
+    }
+
+    void predictBatch(const double *dense, const uint64_t *ids, const uint32_t *offsets, size_t batch, int *classIds) {
+        assemble(dense, ids, offsets, batch);
+        network.predictBatch(inputs.data(), batch, classIds);
+    }
+
+private:
+    vector<double> inputs;
+    vector<double> inputGradient;
+
+    static vector<int> layerSizes(const EmbeddingLayer &embeddings, size_t denseSize, const vector<int> &hiddenSizes, int classCount) {
+        vector<int> sizes{static_cast<int>(denseSize + embeddings.outputSize())};
+        sizes.insert(sizes.end(), hiddenSizes.begin(), hiddenSizes.end());
+        sizes.push_back(classCount);
+        return sizes;
+    }
+
+    void assemble(const double *dense, const uint64_t *ids, const uint32_t *offsets, size_t batch) {
+        size_t width = network.inputSize();
+        inputs.resize(batch * width);
+        for(size_t b=0; b<batch; ++b) {
+            copy_n(dense + b * denseSize, denseSize, inputs.data() + b * width);
+        }
+        embeddings.forward(ids, offsets, batch, inputs.data() + denseSize, width);
+    }
+};
+
+// Checkpoint file: magic, version, the model as written by NeuralNetwork::save, then the training
+// state (counters, generator state, current row order, early stopping progress and best weights).
+void saveCheckpoint(ostream &file, const NeuralNetwork &nn, const TrainingState &state) {
+    auto write = [&](const auto &value) { file.write(reinterpret_cast<const char *>(&value), sizeof(value)); };
+    file.write("NNCK", 4);
+    write(uint32_t(1));
+    nn.save(file);
+    write(int32_t(state.epoch));
+    write(uint64_t(state.position));
+    write(uint64_t(state.step));
+    write(state.baseRate);
+    array<char, NeuralNetwork::generatorTextBytes> text;
+    ospanstream generator{span<char>(text)};
+    generator << state.gen;
+    write(uint64_t(generator.span().size()));
+    file.write(generator.span().data(), generator.span().size());
+    write(uint64_t(state.order.size()));
+    file.write(reinterpret_cast<const char *>(state.order.data()), state.order.size() * sizeof(uint32_t));
+    write(int32_t(state.report.epochsRun));
+    write(int32_t(state.report.bestEpoch));
+    write(state.report.bestValidationLoss);
+    write(uint8_t(!state.bestLayers.empty()));
+    for(const Layer &layer: state.bestLayers) {
+        file.write(reinterpret_cast<const char *>(layer.weights.data()), layer.weights.size() * sizeof(double));
+        file.write(reinterpret_cast<const char *>(layer.biases.data()), layer.biases.size() * sizeof(double));
+    }
+}
+
+// Restores the model saved in a checkpoint into `nn` and returns the state to pass back to train().
+TrainingState loadCheckpoint(const string &filename, NeuralNetwork &nn) {
+    ifstream file(filename, ios::binary);
+    auto read = [&](auto &value) { file.read(reinterpret_cast<char *>(&value), sizeof(value)); };
+    char magic[4];
+    uint32_t version = 0;
+    file.read(magic, 4);
+    read(version);
+    if(!file || memcmp(magic, "NNCK", 4) != 0 || version != 1) {
+        throw runtime_error("Not a checkpoint file: " + filename);
+    }
+    nn = NeuralNetwork::load(file, filename, nn.learningRate);
+
+    TrainingState state;
+    int32_t epoch;
+    uint64_t position, step, size;
+    read(epoch);
+    read(position);
+    read(step);
+    read(state.baseRate);
+    state.epoch = epoch;
+    state.position = position;
+    state.step = step;
+    read(size);
+    string generator(size, '\0');
+    file.read(generator.data(), size);
+    istringstream(generator) >> state.gen;
+    read(size);
+    state.order.resize(size);
+    file.read(reinterpret_cast<char *>(state.order.data()), size * sizeof(uint32_t));
+    int32_t epochsRun, bestEpoch;
+    read(epochsRun);
+    read(bestEpoch);
+    read(state.report.bestValidationLoss);
+    state.report.epochsRun = epochsRun;
+    state.report.bestEpoch = bestEpoch;
+    uint8_t hasBest = 0;
+    read(hasBest);
+    if(hasBest) {
+        state.bestLayers = nn.layers;
+        for(Layer &layer: state.bestLayers) {
+            file.read(reinterpret_cast<char *>(layer.weights.data()), layer.weights.size() * sizeof(double));
+            file.read(reinterpret_cast<char *>(layer.biases.data()), layer.biases.size() * sizeof(double));
+        }
+    }
+    if(!file) {
+        throw runtime_error("Truncated checkpoint file: " + filename);
+    }
+    return state;
+}
+
+// Writes checkpoints without stalling training. submit() serializes the model and training state
+// into an in-memory buffer at a step boundary and returns; the writer thread swaps that buffer
+// with its own and puts it on disk through a temporary file, fsync and an atomic rename, so a
+// crash leaves either the previous or the new checkpoint. If a checkpoint is submitted while the
+// previous one is still pending, the newer one replaces it. reserve() allocates the three buffers
+// up front; a checkpoint that does not fit them grows them instead.
+class AsyncCheckpointer {
+public:
+    explicit AsyncCheckpointer(const string &path)
+        : path(path), temporary(path + ".tmp"), directory(directoryOf(path)), worker(&AsyncCheckpointer::run, this) {}
+
+    ~AsyncCheckpointer() {
+        finish();
+    }
+
+    // Sizes every buffer for checkpoints of up to `bytes`, see NeuralNetwork::checkpointBytes.
+    void reserve(size_t bytes) {
+        lock_guard<mutex> lock(guard);
+        for(Buffer *buffer: {&filling, &pending, &writing}) {
+            buffer->bytes.resize(max(buffer->bytes.size(), bytes));
+        }
+    }
+
+    void submit(const NeuralNetwork &nn, const TrainingState &state) {
+        ospanstream out{span<char>(filling.bytes)};
+        saveCheckpoint(out, nn, state);
+        if(out) {
+            filling.size = out.span().size();
+        }
+        else {
+            ostringstream grown;
+            saveCheckpoint(grown, nn, state);
+            string bytes = move(grown).str();
+            filling.bytes.assign(bytes.begin(), bytes.end());
+            filling.size = bytes.size();
+        }
+        lock_guard<mutex> lock(guard);
+        swap(filling, pending);
+        hasPending = true;
+        wakeUp.notify_one();
+    }
+
+    // Writes the last pending checkpoint, if any, and stops the writer thread.
+    void finish() {
+        {
+            lock_guard<mutex> lock(guard);
+            finishing = true;
+            wakeUp.notify_one();
+        }
+        if(worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    size_t written() const {
+        return checkpointsWritten.load();
+    }
+
+private:
+    struct Buffer {
+        vector<char> bytes;
+        size_t size = 0;
+    };
+
+    string path;
+    string temporary;
+    string directory;
+    mutex guard;
+    condition_variable wakeUp;
+    Buffer filling;
+    Buffer pending;
+    Buffer writing;
+    bool hasPending = false;
+    bool finishing = false;
+    atomic<size_t> checkpointsWritten{0};
+    thread worker;
+
+    void run() {
+        while(true) {
+            {
+                unique_lock<mutex> lock(guard);
+                wakeUp.wait(lock, [this]() { return hasPending || finishing; });
+                if(!hasPending) {
+                    return;
+                }
+                swap(pending, writing);
+                hasPending = false;
+            }
+            if(writeFile(writing.bytes.data(), writing.size)) {
+                ++checkpointsWritten;
+            }
+        }
+    }
+
+    static string directoryOf(const string &path) {
+        size_t slash = path.find_last_of('/');
+        return slash == string::npos ? "." : path.substr(0, max<size_t>(slash, 1));
+    }
+
+    bool writeFile(const char *bytes, size_t size) {
+        int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0) {
+            cerr << "Cannot write checkpoint " << temporary << ": " << strerror(errno) << endl;
+            return false;
+        }
+        size_t done = 0;
+        while(done < size) {
+            ssize_t count = write(fd, bytes + done, size - done);
+            if(count < 0) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                cerr << "Checkpoint write failed: " << strerror(errno) << endl;
+                close(fd);
+                return false;
+            }
+            done += count;
+        }
+        bool synced = fsync(fd) == 0;
+        close(fd);
+        if(!synced || rename(temporary.c_str(), path.c_str()) != 0) {
+            cerr << "Cannot publish checkpoint " << path << ": " << strerror(errno) << endl;
+            return false;
+        }
+
+        // Persist the rename itself.
+        int directoryFd = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+        if(directoryFd >= 0) {
+            fsync(directoryFd);
+            close(directoryFd);
+        }
+        return true;
+    }
+};
+
+// Hardware performance counters for this thread through perf_event_open, counting user-space
+// events only. Cycles lead an event group that the other counters join, so the kernel schedules
+// them together and ratios such as IPC come from the same time windows; a counter that cannot
+// join the group is opened on its own instead, so a machine or container that lacks some events
+// still reports the rest. Counts are scaled up when the kernel multiplexes counters.
+class PerfCounters {
+public:
+    enum Event { Cycles, Instructions, L1dMisses, LlcMisses, BranchMisses, EventCount };
+
+    struct Sample {
+        array<double, EventCount> values{};
+        array<bool, EventCount> valid{};
+    };
+
+    PerfCounters() {
+        const pair<uint32_t, uint64_t> events[EventCount] = {
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+            {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        };
+        int leader = -1;
+        for(int e=0; e<EventCount; ++e) {
+            perf_event_attr attr{};
+            attr.size = sizeof(attr);
+            attr.type = events[e].first;
+            attr.config = events[e].second;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            if(leader >= 0) {
+                // Members follow the leader's enabled state.
+                attr.read_format |= PERF_FORMAT_GROUP;
+                fds[e] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0));
+                if(fds[e] >= 0) {
+                    group.push_back(e);
+                    continue;
+                }
+                attr.read_format &= ~uint64_t(PERF_FORMAT_GROUP);
+            }
+            attr.disabled = 1;
+            if(e == Cycles) {
+                attr.read_format |= PERF_FORMAT_GROUP;
+            }
+            fds[e] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+            if(fds[e] < 0 && error.empty()) {
+                error = strerror(errno);
+            }
+            if(e == Cycles && fds[e] >= 0) {
+                leader = fds[e];
+                group.push_back(e);
+            }
+        }
+    }
+
+    ~PerfCounters() {
+        for(int fd: fds) {
+            if(fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+
+    PerfCounters(const PerfCounters &) = delete;
+    PerfCounters &operator=(const PerfCounters &) = delete;
+
+    bool available() const {
+        return any_of(fds.begin(), fds.end(), [](int fd) { return fd >= 0; });
+    }
+
+    // Why the first unavailable counter could not be opened, if any.
+    const string &unavailableReason() const {
+        return error;
+    }
+
+    void reset() {
+        control(PERF_EVENT_IOC_RESET);
+    }
+
+    void enable() {
+        control(PERF_EVENT_IOC_ENABLE);
+    }
+
+    void disable() {
+        control(PERF_EVENT_IOC_DISABLE);
+    }
+
+    Sample read() const {
+        Sample sample;
+        if(!group.empty()) {
+            // Group layout: member count, time enabled, time running, then one value per member.
+            uint64_t values[3 + EventCount];
+            ssize_t size = static_cast<ssize_t>((3 + group.size()) * sizeof(uint64_t));
+            if(::read(fds[group.front()], values, size) == size && values[0] == group.size() && values[2] != 0) {
+                for(size_t m=0; m<group.size(); ++m) {
+                    sample.values[group[m]] = static_cast<double>(values[3 + m]) * values[1] / values[2];
+                    sample.valid[group[m]] = true;
+                }
+            }
+        }
+        for(int e=0; e<EventCount; ++e) {
+            uint64_t values[3];
+            if(fds[e] < 0 || inGroup(e) || ::read(fds[e], values, sizeof(values)) != sizeof(values) || values[2] == 0) {
+                continue;
+            }
+            sample.values[e] = static_cast<double>(values[0]) * values[1] / values[2];
+            sample.valid[e] = true;
+        }
+        return sample;
+    }
+
+    // Prints IPC and events per sample; counters that could not be read show as n/a.
+    static void print(ostream &out, const string &name, const Sample &sample, size_t samples) {
+        auto perSample = [&](Event e) {
+            return sample.valid[e] ? to_string(sample.values[e] / max<size_t>(samples, 1)) : string("n/a");
+        };
+        out << name << ": IPC ";
+        if(sample.valid[Cycles] && sample.valid[Instructions] && sample.values[Cycles] > 0) {
+            out << sample.values[Instructions] / sample.values[Cycles];
+        }
+        else {
+            out << "n/a";
+        }
+        out << ", per sample: " << perSample(Cycles) << " cycles, " << perSample(Instructions) << " instructions, "
+            << perSample(L1dMisses) << " L1d misses, " << perSample(LlcMisses) << " LLC misses, "
+            << perSample(BranchMisses) << " branch misses" << endl;
+    }
+
+private:
+    array<int, EventCount> fds{};
+    // Events of the cycles-led group, leader first, in the order the group read reports them.
+    vector<int> group;
+    string error;
+
+    bool inGroup(int e) const {
+        return find(group.begin(), group.end(), e) != group.end();
+    }
+
+    void control(unsigned long request) {
+        if(!group.empty()) {
+            ioctl(fds[group.front()], request, PERF_IOC_FLAG_GROUP);
+        }
+        for(int e=0; e<EventCount; ++e) {
+            if(fds[e] >= 0 && !inGroup(e)) {
+                ioctl(fds[e], request, 0);
+            }
+        }
+    }
+};
+
+// Sums buffers across the processes of a ring with the bandwidth-optimal ring all-reduce: a
+// reduce-scatter followed by an all-gather, each of size - 1 rounds in which every rank sends
+// one chunk to the next rank and receives one from the previous rank. Each chunk's final value
+// is computed by a single rank and then copied, so every rank ends up with bit-identical sums.
+// sumAsync() queues a buffer for the communication thread, which lets the caller keep computing
+// while earlier buffers are reduced; wait() blocks until the queue has drained.
+class RingAllReduce {
+public:
+    RingAllReduce(int rank, int size, int sendFd, int receiveFd)
+        : rank(rank), size(size), sendFd(sendFd), receiveFd(receiveFd), worker(&RingAllReduce::run, this) {
+        fcntl(sendFd, F_SETFL, fcntl(sendFd, F_GETFL) | O_NONBLOCK);
+        fcntl(receiveFd, F_SETFL, fcntl(receiveFd, F_GETFL) | O_NONBLOCK);
+    }
+
+    ~RingAllReduce() {
+        {
+            lock_guard<mutex> lock(guard);
+            stopping = true;
+            wakeUp.notify_all();
+        }
+        worker.join();
+        close(sendFd);
+        if(receiveFd != sendFd) {
+            close(receiveFd);
+        }
+    }
+
+    void sum(double *data, size_t count) {
+        if(size == 1) {
+            return;
+        }
+        auto begin = [&](int chunk) { return count * chunk / size; };
+        auto length = [&](int chunk) { return begin(chunk + 1) - begin(chunk); };
+        received.resize(count / size + 1);
+        for(int round=0; round<size-1; ++round) {
+            int sendChunk = (rank - round + size) % size;
+            int receiveChunk = (rank - round - 1 + size) % size;
+            exchange(data + begin(sendChunk), length(sendChunk), received.data(), length(receiveChunk));
+            double *target = data + begin(receiveChunk);
+            for(size_t i=0; i<length(receiveChunk); ++i) {
+                target[i] += received[i];
+            }
+        }
+        for(int round=0; round<size-1; ++round) {
+            int sendChunk = (rank - round + 1 + size) % size;
+            int receiveChunk = (rank - round + size) % size;
+            exchange(data + begin(sendChunk), length(sendChunk), data + begin(receiveChunk), length(receiveChunk));
+        }
+        bytesSent += 2 * (size - 1) * count / size * sizeof(double);
+    }
+
+    void sumAsync(vector<double> &buffer) {
+        lock_guard<mutex> lock(guard);
+        queue.push_back(&buffer);
+        wakeUp.notify_all();
+    }
+
+    void wait() {
+        unique_lock<mutex> lock(guard);
+        wakeUp.wait(lock, [this]() { return (queue.empty() && !busy) || error; });
+        if(error) {
+            rethrow_exception(error);
+        }
+    }
+
+    // Seconds the communication thread spent reducing, and bytes this rank has sent.
+    double communicationSeconds() const {
+        return busySeconds.load();
+    }
+
+    size_t sentBytes() const {
+        return bytesSent.load();
+    }
+
+private:
+    int rank;
+    int size;
+    int sendFd;
+    int receiveFd;
+    vector<double> received;
+    mutex guard;
+    condition_variable wakeUp;
+    deque<vector<double> *> queue;
+    bool busy = false;
+    bool stopping = false;
+    exception_ptr error;
+    atomic<double> busySeconds{0};
+    atomic<size_t> bytesSent{0};
+    thread worker;
+
+    void run() {
+        while(true) {
+            vector<double> *buffer;
+            {
+                unique_lock<mutex> lock(guard);
+                wakeUp.wait(lock, [this]() { return !queue.empty() || stopping; });
+                if(queue.empty() || error) {
+                    return;
+                }
+                buffer = queue.front();
+                queue.pop_front();
+                busy = true;
+            }
+            auto start = chrono::steady_clock::now();
+            try {
+                sum(buffer->data(), buffer->size());
+            }
+            catch(...) {
+                lock_guard<mutex> lock(guard);
+                error = current_exception();
+            }
+            busySeconds = busySeconds + chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            lock_guard<mutex> lock(guard);
+            busy = false;
+            wakeUp.notify_all();
+        }
+    }
+
+    // Sends to the next rank while receiving from the previous one. Doing both in one poll loop
+    // keeps the ring from deadlocking when every rank's send blocks on a full socket buffer.
+    void exchange(const double *send, size_t sendCount, double *receive, size_t receiveCount) {
+        const char *out = reinterpret_cast<const char *>(send);
+        char *in = reinterpret_cast<char *>(receive);
+        size_t outLeft = sendCount * sizeof(double), inLeft = receiveCount * sizeof(double);
+        while(outLeft > 0 || inLeft > 0) {
+            pollfd fds[2] = {{outLeft > 0 ? sendFd : -1, POLLOUT, 0}, {inLeft > 0 ? receiveFd : -1, POLLIN, 0}};
+            if(poll(fds, 2, -1) < 0) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                throw runtime_error(string("poll failed: ") + strerror(errno));
+            }
+            if(fds[0].revents) {
+                ssize_t count = ::send(sendFd, out, outLeft, MSG_NOSIGNAL);
+                if(count < 0 && errno != EAGAIN && errno != EINTR) {
+                    throw runtime_error(string("ring send failed: ") + strerror(errno));
+                }
+                if(count > 0) {
+                    out += count;
+                    outLeft -= count;
+                }
+            }
+            if(fds[1].revents) {
+                ssize_t count = recv(receiveFd, in, inLeft, 0);
+                if(count == 0) {
+                    throw runtime_error("ring peer closed the connection");
+                }
+                if(count < 0 && errno != EAGAIN && errno != EINTR) {
+                    throw runtime_error(string("ring receive failed: ") + strerror(errno));
+                }
+                if(count > 0) {
+                    in += count;
+                    inLeft -= count;
+                }
+            }
+        }
+    }
+};
+
+struct ValidationResult {
+    size_t step;
+    double loss;
+    double accuracy;
+};
+
+// CPUs grouped by NUMA node, read from /sys/devices/system/node. Machines without that
+// directory are treated as a single node holding every CPU this process may run on.
+struct CpuTopology {
+    vector<vector<int>> nodes;
+
+    static CpuTopology detect() {
+        CpuTopology topology;
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        sched_getaffinity(0, sizeof(allowed), &allowed);
+        for(int node=0; ; ++node) {
+            ifstream file("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+            if(!file) {
+                break;
+            }
+            string list;
+            getline(file, list);
+            vector<int> cpus;
+            for(int cpu: parseCpuList(list)) {
+                if(CPU_ISSET(cpu, &allowed)) {
+                    cpus.push_back(cpu);
+                }
+            }
+            if(!cpus.empty()) {
+                topology.nodes.push_back(move(cpus));
+            }
+        }
+        if(topology.nodes.empty()) {
+            topology.nodes.emplace_back();
+            for(int cpu=0; cpu<CPU_SETSIZE; ++cpu) {
+                if(CPU_ISSET(cpu, &allowed)) {
+                    topology.nodes.back().push_back(cpu);
+                }
+            }
+        }
+        return topology;
+    }
+
+    // Parses the kernel's "0-3,8-11" notation.
+    static vector<int> parseCpuList(const string &list) {
+        vector<int> cpus;
+        istringstream stream(list);
+        string range;
+        while(getline(stream, range, ',')) {
+            if(range.empty()) {
+                continue;
+            }
+            size_t dash = range.find('-');
+            int first = stoi(range.substr(0, dash));
+            int last = dash == string::npos ? first : stoi(range.substr(dash + 1));
+            for(int cpu=first; cpu<=last; ++cpu) {
+                cpus.push_back(cpu);
+            }
+        }
+        return cpus;
+    }
+
+    size_t cpuCount() const {
+        size_t count = 0;
+        for(const vector<int> &cpus: nodes) {
+            count += cpus.size();
+        }
+        return count;
+    }
+
+    // Threads are dealt to nodes round robin, then to the CPUs within their node, so that a few
+    // threads spread over every node's memory bandwidth.
+    size_t nodeForThread(size_t t) const {
+        return t % nodes.size();
+    }
+
+    int cpuForThread(size_t t) const {
+        const vector<int> &cpus = nodes[nodeForThread(t)];
+        return cpus[(t / nodes.size()) % cpus.size()];
+    }
+};
+
+bool pinCurrentThread(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+// One copy of a read-mostly model per NUMA node. Each copy is made by a thread pinned to its
+// node, so first touch places its pages in that node's memory. evaluate() pins every worker
+// thread, which then allocates its buffers locally and reads the replica of its own node.
+class ReplicatedModel {
+public:
+    ReplicatedModel(const NeuralNetwork &model, const CpuTopology &topology) : topology(topology) {
+        replicas.resize(topology.nodes.size());
+        vector<thread> threads;
+        for(size_t node=0; node<replicas.size(); ++node) {
+            threads.emplace_back([&, node]() {
+                pinCurrentThread(topology.nodes[node].front());
+                replicas[node] = make_unique<NeuralNetwork>(model);
+            });
+        }
+        for(thread &worker: threads) {
+            worker.join();
+        }
+    }
+
+    const NeuralNetwork &local(size_t node) const {
+        return *replicas[node];
+    }
+
+    EvaluationReport evaluate(const DatasetView &data, unsigned threadCount) const {
+        const NeuralNetwork &model = *replicas.front();
+        threadCount = static_cast<unsigned>(clamp<size_t>(threadCount, 1, max<size_t>(data.size() / (4 * NeuralNetwork::inferenceBatch), 1)));
+        vector<EvaluationReport> partials(threadCount, EvaluationReport(model.outputSize()));
+        vector<thread> threads;
+        for(unsigned t=0; t<threadCount; ++t) {
+            threads.emplace_back([&, t]() {
+                pinCurrentThread(topology.cpuForThread(t));
+                local(topology.nodeForThread(t)).evaluateRows(data, data.size() * t / threadCount, data.size() * (t + 1) / threadCount, partials[t]);
+            });
+        }
+        for(thread &worker: threads) {
+            worker.join();
+        }
+        for(unsigned t=1; t<threadCount; ++t) {
+            partials[0].merge(partials[t]);
+        }
+        return partials[0];
+    }
+
+private:
+    CpuTopology topology;
+    vector<unique_ptr<NeuralNetwork>> replicas;
+};
+
+// Serves the weighted average of several networks with the same topology in one batched pass.
+// Member layers are stacked into fused layers: the first fused layer holds every member's
+// first-layer rows, with each member's normalizer folded in, so the raw input batch is streamed
+// once for all members, as one wide matrix product; deeper fused layers are block diagonal and
+// evaluated group by group. Each group's weights are packed into panels for denseForwardPacked.
+class Ensemble {
+public:
+    Ensemble(const vector<NeuralNetwork> &members, vector<double> memberWeights = {})
+        : memberCount(members.size()), memberWeights(move(memberWeights)) {
+        if(members.empty()) {
+            throw runtime_error("An ensemble needs at least one member");
+        }
+        if(this->memberWeights.empty()) {
+            this->memberWeights.assign(memberCount, 1);
+        }
+        if(this->memberWeights.size() != memberCount) {
+            throw runtime_error("Need one weight per ensemble member");
+        }
+        double total = accumulate(this->memberWeights.begin(), this->memberWeights.end(), 0.0);
+        for(double &weight: this->memberWeights) {
+            weight /= total;
+        }
+
+        const NeuralNetwork &first = members.front();
+        for(const Layer &layer: first.layers) {
+            layers.emplace_back(layer.outputSize * memberCount, layer.inputSize, layer.activation);
+        }
+        for(size_t m=0; m<memberCount; ++m) {
+            const NeuralNetwork &member = members[m];
+            if(member.layers.size() != first.layers.size()) {
+                throw runtime_error("Ensemble members must share one topology");
+            }
+            for(size_t l=0; l<layers.size(); ++l) {
+                const Layer &layer = member.layers[l];
+                if(layer.inputSize != first.layers[l].inputSize || layer.outputSize != first.layers[l].outputSize ||
+                    layer.activation != first.layers[l].activation) {
+                    throw runtime_error("Ensemble members must share one topology");
+                }
+                double *weights = layers[l].weights.data() + m * layer.weights.size();
+                double *biases = layers[l].biases.data() + m * layer.outputSize;
+                copy(layer.weights.begin(), layer.weights.end(), weights);
+                copy(layer.biases.begin(), layer.biases.end(), biases);
+                if(l == 0 && member.normalizer.fitted()) {
+                    for(size_t o=0; o<layer.outputSize; ++o) {
+                        for(size_t i=0; i<layer.inputSize; ++i) {
+                            double &w = weights[o * layer.inputSize + i];
+                            w *= member.normalizer.inverseStd[i];
+                            biases[o] -= w * member.normalizer.mean[i];
+                        }
+                    }
+                }
+            }
+        }
+        for(size_t l=0; l<layers.size(); ++l) {
+            Layer &layer = layers[l];
+            size_t groups = groupCount(l), groupOutputs = layer.outputSize / groups;
+            size_t blockSize = layer.inputSize * groupOutputs, packedSize = packedPanelsSize(groupOutputs, layer.inputSize);
+            vector<double> packed(groups * packedSize);
+            for(size_t g=0; g<groups; ++g) {
+                packPanels(layer.weights.data() + g * blockSize, groupOutputs, layer.inputSize, packed.data() + g * packedSize);
+            }
+            layer.weights = move(packed);
+        }
+    }
+
+    size_t inputSize() const {
+        return layers.front().inputSize;
+    }
+
+    size_t outputSize() const {
+        return layers.back().outputSize / memberCount;
+    }
+
+    // Writes the averaged class probabilities of `batch` contiguous raw input rows.
+    void predictProbabilities(const double *inputs, size_t batch, double *probabilities, Workspace &workspace) const {
+        const double *averaged = averageMembers(inputs, batch, workspace);
+        for(size_t b=0; b<batch; ++b) {
+            copy_n(averaged + b * memberCount * outputSize(), outputSize(), probabilities + b * outputSize());
+        }
+    }
+
+    void predictBatch(const double *inputs, size_t count, int *classIds, Workspace &workspace) const {
+        for(size_t first=0; first<count; first+=NeuralNetwork::inferenceBatch) {
+            size_t batch = min(NeuralNetwork::inferenceBatch, count - first);
+            const double *averaged = averageMembers(inputs + first * inputSize(), batch, workspace);
+            for(size_t b=0; b<batch; ++b) {
+                const double *row = averaged + b * memberCount * outputSize();
+                classIds[first + b] = static_cast<int>(max_element(row, row + outputSize()) - row);
+            }
+        }
+    }
+
+private:
+    size_t memberCount;
+    vector<double> memberWeights;
+    vector<Layer> layers;
+
+    // The first fused layer is one dense block; deeper ones have a block per member.
+    size_t groupCount(size_t l) const {
+        return l == 0 ? 1 : memberCount;
+    }
+
+    // Runs the fused layers and averages each row's member probabilities in place, into the first
+    // member's slot of the logits; rows of the result are memberCount * outputSize() apart.
+    const double *averageMembers(const double *inputs, size_t batch, Workspace &workspace) const {
+        workspace.activations.resize(layers.size() + 1);
+        const double *input = inputs;
+        for(size_t l=0; l<layers.size(); ++l) {
+            const Layer &layer = layers[l];
+            double *output = workspace.acquire(l + 1, batch * layer.outputSize);
+            size_t groups = groupCount(l), groupOutputs = layer.outputSize / groups;
+            size_t packedSize = packedPanelsSize(groupOutputs, layer.inputSize);
+            // The first layer's groups all read the whole input row, the others their member's slice.
+            size_t inputStride = l == 0 ? layer.inputSize : groups * layer.inputSize;
+            withActivation(layer.activation, [&](auto policy) {
+                for(size_t g=0; g<groups; ++g) {
+                    denseForwardPacked<decltype(policy)>(layer.weights.data() + g * packedSize,
+                        layer.biases.data() + g * groupOutputs, input + (l == 0 ? 0 : g * layer.inputSize), inputStride,
+                        output + g * groupOutputs, layer.outputSize, batch, layer.inputSize, groupOutputs);
+                }
+            });
+            input = output;
+        }
+
+        size_t classes = outputSize();
+        double *logits = workspace.activations.back().data();
+        for(size_t b=0; b<batch; ++b) {
+            double *row = logits + b * memberCount * classes;
+            for(size_t m=0; m<memberCount; ++m) {
+                softmax(row + m * classes, classes);
+            }
+            for(size_t c=0; c<classes; ++c) {
+                double sum = 0;
+                for(size_t m=0; m<memberCount; ++m) {
+                    sum += memberWeights[m] * row[m * classes + c];
+                }
+                row[c] = sum;
+            }
+        }
+        return logits;
+    }
+};
+
+// Scores weight snapshots against a validation set on its own thread. submit() only copies
+// the weights into a pending slot, so training never waits for an evaluation; if snapshots
+// arrive faster than they can be scored, the newest one replaces the unscored one. The slot and
+// the evaluator's workspace are allocated by the constructor, so submit() copies into existing buffers.
+class AsyncValidator {
+public:
+    AsyncValidator(const NeuralNetwork &model, const DatasetView &validation, size_t patience = 0)
+        : evaluator(model), validation(validation), patience(patience), pendingLayers(model.layers),
+          report(model.outputSize()), inputs(NeuralNetwork::inferenceBatch * model.inputSize()) {
+        MemoryPlanOptions planOptions;
+        planOptions.checkpointInterval = model.checkpointInterval;
+        planOptions.bfloat16Weights = !model.layers.front().packedWeights.empty();
+        evaluator.reserveWorkspace(evaluator.workspace,
+            planMemory(model.layerSizes(), NeuralNetwork::inferenceBatch, inferencePlanOptions(planOptions)));
+        worker = thread(&AsyncValidator::run, this);
+    }
+
+    ~AsyncValidator() {
+        finish();
+    }
+
+    void submit(size_t step, const vector<Layer> &layers) {
+        lock_guard<mutex> lock(guard);
+        pendingLayers = layers;
+        pendingStep = step;
+        hasPending = true;
+        wakeUp.notify_one();
+    }
+
+    // Scores the last pending snapshot, if any, and stops the worker thread.
+    void finish() {
+        {
+            lock_guard<mutex> lock(guard);
+            finishing = true;
+            wakeUp.notify_one();
+        }
+        if(worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    // True once `patience` consecutive snapshots failed to improve on the best validation loss.
+    bool shouldStop() const {
+        return stopRequested.load(memory_order_relaxed);
+    }
+
+    vector<ValidationResult> history() const {
+        lock_guard<mutex> lock(guard);
+        return results;
+    }
+
+private:
+    NeuralNetwork evaluator;
+    DatasetView validation;
+    size_t patience;
+    mutable mutex guard;
+    condition_variable wakeUp;
+    vector<Layer> pendingLayers;
+    size_t pendingStep = 0;
+    bool hasPending = false;
+    bool finishing = false;
+    vector<ValidationResult> results;
+    EvaluationReport report;
+    vector<double> inputs;
+    double bestLoss = numeric_limits<double>::infinity();
+    size_t evaluationsWithoutImprovement = 0;
+    atomic<bool> stopRequested{false};
+    thread worker;
+
+    void run() {
+        while(true) {
+            size_t step;
+            {
+                unique_lock<mutex> lock(guard);
+                wakeUp.wait(lock, [this]() { return hasPending || finishing; });
+                if(!hasPending) {
+                    return;
+                }
+                swap(evaluator.layers, pendingLayers);
+                step = pendingStep;
+                hasPending = false;
+            }
+
+            report.reset();
+            evaluator.evaluateRows(validation, 0, validation.size(), report, evaluator.workspace, inputs.data());
+            ValidationResult result{step, report.logLoss(), report.accuracy()};
+
+            lock_guard<mutex> lock(guard);
+            results.push_back(result);
+            if(result.loss < bestLoss) {
+                bestLoss = result.loss;
+                evaluationsWithoutImprovement = 0;
+            }
+            else if(patience > 0 && ++evaluationsWithoutImprovement >= patience) {
+                stopRequested.store(true, memory_order_relaxed);
+            }
+        }
+    }
+};
+
+// A model that keeps learning from streaming events while serving predictions. Readers run inside
+// read(), which never blocks: it bumps a reader counter for the current epoch and loads the
+// published network pointer. partialFit() trains a private copy, publishes it with an atomic
+// pointer swap and, RCU style, waits for readers of the previous epoch to drain before reusing
+// the retired copy, so neither side ever sees a half-updated network.
+class OnlineModel {
+public:
+    size_t batchSize = 8;
+    size_t replaySamplesPerUpdate = 0;
+
+    OnlineModel(const NeuralNetwork &initial, size_t replayCapacity = 0)
+        : learner(initial), replayCapacity(replayCapacity), gen(random_device{}()) {
+        current.store(new Published{initial, 0});
+        retired = new Published{initial, 0};
+        replay.featureCount = initial.inputSize();
+        replay.classCount = initial.outputSize();
+        runningStatistics = initial.normalizer;
+    }
+
+    ~OnlineModel() {
+        delete current.load();
+        delete retired;
+    }
+
+    OnlineModel(const OnlineModel &) = delete;
+    OnlineModel &operator=(const OnlineModel &) = delete;
+
+    // Calls body with the latest published network; bring your own Workspace for forward passes.
+    template<typename Body>
+    auto read(Body &&body) const {
+        return readVersioned([&](const NeuralNetwork &network, uint64_t) { return body(network); });
+    }
+
+    // Like read(), but body also receives the version of the network it is given, e.g. to key
+    // cached results by the model that produced them.
+    template<typename Body>
+    auto readVersioned(Body &&body) const {
+        size_t slot = epoch.load() & 1;
+        readers[slot].fetch_add(1);
+        struct Exit {
+            atomic<size_t> &counter;
+            ~Exit() { counter.fetch_sub(1); }
+        } exit{readers[slot]};
+        const Published *published = current.load();
+        return body(published->network, published->version);
+    }
+
+    // Number of networks published so far.
+    uint64_t version() const {
+        return epoch.load() / 2;
+    }
+
+    // Applies mini-batch SGD over `count` new events, each batch topped up with samples drawn from
+    // the replay buffer, after folding the events into the running normalization statistics.
+    void partialFit(const double *inputs, const int *labels, size_t count) {
+        lock_guard<mutex> lock(writer);
+        size_t inputSize = learner.inputSize();
+        for(size_t i=0; i<count; ++i) {
+            runningStatistics.update(span<const double>(inputs + i * inputSize, inputSize));
+        }
+        runningStatistics.finalize();
+        learner.normalizer = runningStatistics;
+
+        for(size_t first=0; first<count; first+=batchSize) {
+            size_t fresh = min(batchSize, count - first);
+            batchInputs.assign(inputs + first * inputSize, inputs + (first + fresh) * inputSize);
+            batchLabels.assign(labels + first, labels + first + fresh);
+            for(size_t i=0; i<replaySamplesPerUpdate && replay.size() > 0; ++i) {
+                size_t row = uniform_int_distribution<size_t>(0, replay.size() - 1)(gen);
+                batchInputs.insert(batchInputs.end(), replay.row(row).begin(), replay.row(row).end());
+                batchLabels.push_back(replay.labels[row]);
+            }
+            learner.forward(batchInputs.data(), batchLabels.size(), learner.workspace);
+            learner.backward(batchLabels.data(), learner.workspace);
+
+            for(size_t i=first; i<first + fresh; ++i) {
+                remember(span<const double>(inputs + i * inputSize, inputSize), labels[i]);
+            }
+        }
+        publish();
+    }
+
+private:
+    struct Published {
+        NeuralNetwork network;
+        uint64_t version;
+    };
+
+    atomic<Published *> current;
+    atomic<uint64_t> epoch{0};
+    mutable atomic<size_t> readers[2] = {0, 0};
+    Published *retired;
+    NeuralNetwork learner;
+    Normalizer runningStatistics;
+    mutex writer;
+    Dataset replay;
+    size_t replayCapacity;
+    uint64_t eventsSeen = 0;
+    mt19937 gen;
+    vector<double> batchInputs;
+    vector<int> batchLabels;
+
+    // Reservoir sampling keeps the replay buffer a uniform sample of every event seen so far.
+    void remember(span<const double> input, int label) {
+        ++eventsSeen;
+        if(replayCapacity == 0) {
+            return;
+        }
+        if(replay.size() < replayCapacity) {
+            replay.addRow(input, label);
+            return;
+        }
+        uint64_t slot = uniform_int_distribution<uint64_t>(0, eventsSeen - 1)(gen);
+        if(slot < replayCapacity) {
+            copy(input.begin(), input.end(), replay.features.begin() + slot * replay.featureCount);
+            replay.labels[slot] = static_cast<uint16_t>(label);
+        }
+    }
+
+    // A reader may have sampled an older epoch just before a flip, so its counter can sit in either
+    // slot. Flipping twice and draining each slot in turn covers every reader that could still hold
+    // the retired pointer; readers arriving later only ever see the new one.
+    void publish() {
+        retired->network = learner;
+        retired->version = current.load()->version + 1;
+        retired = current.exchange(retired);
+        for(int phase=0; phase<2; ++phase) {
+            size_t slot = epoch.fetch_add(1) & 1;
+            while(readers[slot].load() != 0) {
+                this_thread::yield();
+            }
+        }
+    }
+};
+
+// Sharded LRU cache of predicted classes in front of predict()/predictBatch(). Entries are keyed
+// by a hash of the normalized input and keep the normalized input itself, so a hash collision
+// is a miss rather than a wrong answer. Each shard has its own lock and remembers the model
+// version its entries came from; a lookup with a newer version empties the shard first, so a
+// model swap never serves stale predictions. The misses of a predictBatch() call are gathered
+// and run through the model as one batch.
+class PredictionCache {
+public:
+    explicit PredictionCache(size_t capacity, size_t shardCount = 16) : shards(max<size_t>(shardCount, 1)) {
+        for(Shard &shard: shards) {
+            shard.capacity = max<size_t>(capacity / shards.size(), 1);
+        }
+    }
+
+    void predictBatch(const NeuralNetwork &model, uint64_t modelVersion, const double *inputs, size_t count, int *classIds, Workspace &workspace) {
+        size_t inputSize = model.inputSize();
+        vector<double> normalized(inputSize);
+        missRows.clear();
+        missInputs.clear();
+        missKeys.clear();
+        missHashes.clear();
+        for(size_t i=0; i<count; ++i) {
+            const double *input = inputs + i * inputSize;
+            if(model.normalizer.fitted()) {
+                model.normalizer.transform(span<const double>(input, inputSize), normalized);
+            }
+            else {
+                copy_n(input, inputSize, normalized.begin());
+            }
+            uint64_t hash = hashInput(normalized);
+            if(lookup(hash, normalized, modelVersion, classIds[i])) {
+                ++hits;
+                continue;
+            }
+            ++misses;
+            missRows.push_back(i);
+            missHashes.push_back(hash);
+            missInputs.insert(missInputs.end(), input, input + inputSize);
+            missKeys.insert(missKeys.end(), normalized.begin(), normalized.end());
+        }
+        if(missRows.empty()) {
+            return;
+        }
+        missClasses.resize(missRows.size());
+        model.predictBatch(missInputs.data(), missRows.size(), missClasses.data(), workspace);
+        for(size_t m=0; m<missRows.size(); ++m) {
+            classIds[missRows[m]] = missClasses[m];
+            insert(missHashes[m], span<const double>(missKeys.data() + m * inputSize, inputSize), modelVersion, missClasses[m]);
+        }
+    }
+
+    int predict(const NeuralNetwork &model, uint64_t modelVersion, span<const double> input, Workspace &workspace) {
+        int classId;
+        predictBatch(model, modelVersion, input.data(), 1, &classId, workspace);
+        return classId;
+    }
 
-class Layer {  
-public:
-    vector<Neuron> neurons;
-    Layer(int neuronCount, int prevLayerNeuronCount) {
-        neurons.resize(neuronCount);
-        random_device rd;
-        mt19937 gen(rd());
-        uniform_real_distribution<> dis(-1, 1);
+    size_t hitCount() const {
+        return hits.load();
+    }
+
+    size_t missCount() const {
+        return misses.load();
+    }
+
+    double hitRate() const {
+        return static_cast<double>(hits.load()) / max<size_t>(hits.load() + misses.load(), 1);
+    }
+
+private:
+    struct Entry {
+        uint64_t hash;
+        vector<double> key;
+        int classId;
+    };
 
-        for(Neuron &neuron: neurons) {
-            neuron.weights.resize(prevLayerNeuronCount);
-            generate(neuron.weights.begin(), neuron.weights.end(), [&](){ return dis(gen); });
-            neuron.bias = dis(gen);
+    struct Shard {
+        mutex guard;
+        size_t capacity = 0;
+        uint64_t version = 0;
+        list<Entry> entries;
+        unordered_map<uint64_t, list<Entry>::iterator> index;
+
+        // Drops every entry once a newer model shows up. Returns false for callers still holding
+        // an older model, whose results must neither be served from nor stored in this shard.
+        bool synchronize(uint64_t modelVersion) {
+            if(modelVersion > version) {
+                entries.clear();
+                index.clear();
+                version = modelVersion;
+            }
+            return modelVersion == version;
+        }
+    };
+
+    vector<Shard> shards;
+    atomic<size_t> hits{0};
+    atomic<size_t> misses{0};
+    // Miss staging for the calling thread's current predictBatch().
+    static thread_local inline vector<size_t> missRows;
+    static thread_local inline vector<double> missInputs;
+    static thread_local inline vector<double> missKeys;
+    static thread_local inline vector<uint64_t> missHashes;
+    static thread_local inline vector<int> missClasses;
+
+    static uint64_t hashInput(const vector<double> &input) {
+        uint64_t hash = 0x9e3779b97f4a7c15ull ^ input.size();
+        for(double value: input) {
+            uint64_t bits;
+            memcpy(&bits, &value, sizeof(bits));
+            hash = (hash ^ bits) * 0xff51afd7ed558ccdull;
+            hash ^= hash >> 32;
         }
+        hash ^= hash >> 33;
+        hash *= 0xc4ceb9fe1a85ec53ull;
+        return hash ^ (hash >> 33);
+    }
+
+    Shard &shardFor(uint64_t hash) {
+        return shards[hash % shards.size()];
     }
 
+    bool lookup(uint64_t hash, const vector<double> &key, uint64_t modelVersion, int &classId) {
+        Shard &shard = shardFor(hash);
+        lock_guard<mutex> lock(shard.guard);
+        if(!shard.synchronize(modelVersion)) {
+            return false;
+        }
+        auto found = shard.index.find(hash);
+        if(found == shard.index.end() || !equal(key.begin(), key.end(), found->second->key.begin(), found->second->key.end())) {
+            return false;
+        }
+        shard.entries.splice(shard.entries.begin(), shard.entries, found->second);
+        classId = found->second->classId;
+        return true;
+    }
 
-    vector<double> getOutputs() {
-        vector<double> outputs;
-        for(Neuron &neuron: neurons) {
-            outputs.push_back(neuron.value);
+    void insert(uint64_t hash, span<const double> key, uint64_t modelVersion, int classId) {
+        Shard &shard = shardFor(hash);
+        lock_guard<mutex> lock(shard.guard);
+        if(!shard.synchronize(modelVersion)) {
+            return;
+        }
+        auto found = shard.index.find(hash);
+        if(found != shard.index.end()) {
+            shard.entries.erase(found->second);
+            shard.index.erase(found);
+        }
+        else if(shard.entries.size() >= shard.capacity) {
+            shard.index.erase(shard.entries.back().hash);
+            shard.entries.pop_back();
         }
-        return outputs;
+        shard.entries.push_front({hash, vector<double>(key.begin(), key.end()), classId});
+        shard.index[hash] = shard.entries.begin();
     }
 };
 
-class NeuralNetwork {
-public:
-    vector<Layer> layers;
-    double learningRate;
+// Parses one iris CSV row into its four features and class index, returns false for rows to skip.
+bool parseIrisLine(const string &line, int lineNumber, vector<double> &input, int &label) {
+    istringstream lineStream(line);
+    input.assign(4, 0);
 
-    NeuralNetwork(const vector<int> &layerSizes, double learningRate)
-        : learningRate(learningRate) {
-        for(size_t i=1; i<layerSizes.size(); ++i) {
-            layers.emplace_back(layerSizes[i], layerSizes[i-1]);
+    for (size_t i = 0; i < 4; ++i) {
+        string value;
+        getline(lineStream, value, ',');
+
+        if (value.empty()) {
+            cerr << "Empty value found at line " << lineNumber << ", column " << (i + 1) << endl;
+            continue;
+        }
+
+        try {
+            input[i] = stod(value);
+        } catch (const invalid_argument &e) {
+            cerr << "Invalid value found at line " << 
+            lineNumber << ", column " << (i + 1) << ": " << value << endl;
+            continue;
         }
     }
 
-    double relu(double x) {
-        return max(0.0, x);
+    string labelName;
+    getline(lineStream, labelName);
+    if (labelName == "Iris-setosa") {
+        label = 0;
+    } else if (labelName == "Iris-versicolor") {
+        label = 1;
+    } else if (labelName == "Iris-virginica") {
+        label = 2;
+    } else {
+        cerr << "Invalid label found at line " << lineNumber << ": " << labelName << endl;
+        return false;
     }
+    return true;
+}
 
-    double reluDerivative(double x) {
-        return x > 0 ? 1 : 0;
+// Converts the iris CSV into the binary dataset format one row at a time, so the
+// source never has to fit in memory.
+void convertIrisCsvToBinary(const string &csvFilename, const string &binaryFilename) {
+    ifstream csv(csvFilename);
+    ofstream binary(binaryFilename, ios::binary);
+    if(!csv || !binary) {
+        throw runtime_error("Cannot open " + (csv ? binaryFilename : csvFilename));
     }
+    BinaryDatasetHeader header;
+    header.featureCount = 4;
+    header.classCount = 3;
+    binary.write(reinterpret_cast<const char *>(&header), sizeof(header));
 
+    string line;
+    int lineNumber = 0;
+    vector<double> input;
+    vector<float> features(header.featureCount);
+    int label;
+    while (getline(csv, line)) {
+        lineNumber++;
+        if(!parseIrisLine(line, lineNumber, input, label)) {
+            continue;
+        }
+        copy(input.begin(), input.end(), features.begin());
+        uint16_t storedLabel = static_cast<uint16_t>(label);
+        binary.write(reinterpret_cast<const char *>(features.data()), features.size() * sizeof(float));
+        binary.write(reinterpret_cast<const char *>(&storedLabel), sizeof(storedLabel));
+        header.rowCount++;
+    }
+    binary.seekp(0);
+    binary.write(reinterpret_cast<const char *>(&header), sizeof(header));
+}
 
-    vector<double> softmax(const vector<double> &x) {
-        vector<double> result(x.size());
-        double maxElement = *max_element(x.begin(), x.end());
-        double expSum = 0;
+Dataset loadIrsihDataset(const string &filename) {
+    Dataset dataset;
+    dataset.featureCount = 4;
+    dataset.classCount = 3;
 
-        for(size_t i=0; i<x.size(); ++i) {
-            result[i] = exp(x[i] - maxElement);
-            expSum += result[i];
-        }
-        for(double &element: result) {
-            element /= expSum;
+    ifstream file(filename);
+    if(!file) {
+        throw runtime_error("Cannot open " + filename);
+    }
+    string line;
+    int lineNumber=0;
+    vector<double> input;
+    int label;
+    while (getline(file, line)) {
+        lineNumber++;
+        if (parseIrisLine(line, lineNumber, input, label)) {
+            dataset.addRow(input, label);
         }
-        return result;
     }
+    return dataset;
+}
 
-
-    void forwardPropagation (const vector<double> &inputValues) {
-        for(size_t i=0; i<layers[0].neurons.size(); ++i) {
-            layers[0].neurons[i].value = inputValues[i];
+// Reads a whole binary dataset into memory.
+Dataset loadBinaryDataset(const string &filename) {
+    ifstream file(filename, ios::binary);
+    BinaryDatasetHeader header;
+    file.read(reinterpret_cast<char *>(&header), sizeof(header));
+    if(!file || memcmp(header.magic, "NNDS", 4) != 0 || header.version != 1) {
+        throw runtime_error("Not a binary dataset: " + filename);
+    }
+    Dataset dataset;
+    dataset.featureCount = header.featureCount;
+    dataset.classCount = header.classCount;
+    dataset.features.resize(header.rowCount * header.featureCount);
+    dataset.labels.resize(header.rowCount);
+    vector<float> features(header.featureCount);
+    for(uint64_t i=0; i<header.rowCount; ++i) {
+        file.read(reinterpret_cast<char *>(features.data()), features.size() * sizeof(float));
+        file.read(reinterpret_cast<char *>(&dataset.labels[i]), sizeof(uint16_t));
+        if(file && dataset.labels[i] >= header.classCount) {
+            throw runtime_error("Label " + to_string(dataset.labels[i]) + " out of range for " + to_string(header.classCount) +
+                " classes in " + filename);
         }
+        copy(features.begin(), features.end(), dataset.features.begin() + i * header.featureCount);
+    }
+    if(!file) {
+        throw runtime_error("Truncated binary dataset: " + filename);
+    }
+    return dataset;
+}
 
-        for(size_t i=1; i<layers.size(); ++i) {
-            for(Neuron &neuron: layers[i].neurons) {
-                neuron.value = 0;
-                for(size_t j=0; j<neuron.weights.size(); ++j) {
-                    neuron.value += neuron.weights[j] * layers[i-1].neurons[j].value;
-                }
-                if(i!= layers.size()-1) {
-                    neuron.value = relu(neuron.value + neuron.bias);
-                }
-                else {
-                    neuron.value = neuron.value + neuron.bias;
-                }
+// Reads a CSV of numeric features followed by an integer class label per line, as written by
+// generateSyntheticDataset. The first row fixes the feature count; the class count is the
+// largest label plus one.
+Dataset loadNumericCsv(const string &filename) {
+    ifstream file(filename);
+    if(!file) {
+        throw runtime_error("Cannot open " + filename);
+    }
+    Dataset dataset;
+    string line;
+    int lineNumber = 0;
+    vector<double> input;
+    while(getline(file, line)) {
+        lineNumber++;
+        if(line.empty()) {
+            continue;
+        }
+        input.clear();
+        const char *position = line.data(), *end = line.data() + line.size();
+        while(true) {
+            double value;
+            auto [next, error] = from_chars(position, end, value);
+            if(error != errc()) {
+                throw runtime_error("Invalid value at line " + to_string(lineNumber) + " of " + filename);
             }
-            if(i==layers.size()-1) {
-                vector<double> output = layers.back().getOutputs();
-                output = softmax(output);
-                for(size_t j=0; j<layers.back().neurons.size(); ++j) {
-                    layers.back().neurons[j].value = output[j];
-                }
+            input.push_back(value);
+            if(next == end) {
+                break;
             }
+            if(*next != ',') {
+                throw runtime_error("Expected a comma at line " + to_string(lineNumber) + " of " + filename);
+            }
+            position = next + 1;
+        }
+        double label = input.back();
+        input.pop_back();
+        if(input.empty() || label < 0 || label >= 65536 || label != floor(label)) {
+            throw runtime_error("Need features and an integer label below 65536 at line " + to_string(lineNumber) + " of " + filename);
+        }
+        if(dataset.featureCount == 0) {
+            dataset.featureCount = input.size();
+        }
+        else if(input.size() != dataset.featureCount) {
+            throw runtime_error("Line " + to_string(lineNumber) + " of " + filename + " has " + to_string(input.size()) +
+                " features instead of " + to_string(dataset.featureCount));
         }
+        dataset.classCount = max<size_t>(dataset.classCount, static_cast<size_t>(label) + 1);
+        dataset.addRow(input, static_cast<int>(label));
     }
+    return dataset;
+}
+
+// Loads either dataset format, telling them apart by the binary magic.
+Dataset loadDataset(const string &filename) {
+    char magic[4] = {};
+    ifstream(filename, ios::binary).read(magic, 4);
+    return memcmp(magic, "NNDS", 4) == 0 ? loadBinaryDataset(filename) : loadNumericCsv(filename);
+}
+
+struct SyntheticDatasetOptions {
+    uint64_t rows = 1000000;
+    uint32_t featureCount = 256;
+    uint32_t classCount = 10;
+    double sparsity = 0;
+    double noise = 1;
+    unsigned seed = 1;
+};
 
-    void backProgpagation(const vector<double> &targetValues) {
-        vector<double> outputDeltas(layers.back().neurons.size());
-        for(size_t i=0; i<layers.back().neurons.size(); ++i) {
-            outputDeltas[i] = layers.back().neurons[i].value - targetValues[i];
+// Writes a classification dataset of Gaussian clusters, one random centroid per class, to a CSV
+// file (features then the integer label per line) and/or the binary dataset format. A fraction
+// `sparsity` of each row's features is zeroed and `noise` is the standard deviation around the
+// centroid. Rows are generated and written one at a time, so the size is only limited by disk.
+// An empty filename skips that output.
+void generateSyntheticDataset(const SyntheticDatasetOptions &options, const string &csvFilename, const string &binaryFilename) {
+    ofstream csv, binary;
+    if(!csvFilename.empty()) {
+        csv.open(csvFilename);
+        if(!csv) {
+            throw runtime_error("Cannot open " + csvFilename);
+        }
+    }
+    BinaryDatasetHeader header;
+    header.rowCount = options.rows;
+    header.featureCount = options.featureCount;
+    header.classCount = options.classCount;
+    if(!binaryFilename.empty()) {
+        binary.open(binaryFilename, ios::binary);
+        if(!binary) {
+            throw runtime_error("Cannot open " + binaryFilename);
         }
+        binary.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    }
 
-        vector<vector<double>> hiddenDeltas(layers.size()-1);
-        for(int i =layers.size()- 2; i>=0; --i) {
-            hiddenDeltas[i].resize(layers[i].neurons.size());
-            for(size_t j=0 ;j<layers[i].neurons.size(); ++j) {
-                double sum = 0;
-                for(size_t k=0; k<layers[i+1].neurons.size(); ++k) {
-                    sum += layers[i+1].neurons[k].weights[j] * (i== layers.size()-2 ? outputDeltas[k] : hiddenDeltas[i+1][k]);
-                }
+    mt19937_64 gen(options.seed);
+    uniform_real_distribution<float> centroidDistribution(-1, 1);
+    vector<float> centroids(size_t(options.classCount) * options.featureCount);
+    generate(centroids.begin(), centroids.end(), [&]() { return centroidDistribution(gen); });
 
-                hiddenDeltas[i][j] = reluDerivative(layers[i].neurons[j].value) * sum;
+    normal_distribution<float> noise(0, static_cast<float>(options.noise));
+    bernoulli_distribution zeroed(options.sparsity);
+    uniform_int_distribution<uint32_t> classDistribution(0, options.classCount - 1);
+    vector<float> features(options.featureCount);
+    string line;
+    char number[32];
+    for(uint64_t row=0; row<options.rows; ++row) {
+        uint16_t label = static_cast<uint16_t>(classDistribution(gen));
+        const float *centroid = centroids.data() + size_t(label) * options.featureCount;
+        for(uint32_t j=0; j<options.featureCount; ++j) {
+            features[j] = options.sparsity > 0 && zeroed(gen) ? 0 : centroid[j] + noise(gen);
+        }
+        if(binary.is_open()) {
+            binary.write(reinterpret_cast<const char *>(features.data()), features.size() * sizeof(float));
+            binary.write(reinterpret_cast<const char *>(&label), sizeof(label));
+        }
+        if(csv.is_open()) {
+            line.clear();
+            for(float value: features) {
+                line.append(number, to_chars(number, number + sizeof(number), value).ptr);
+                line += ',';
             }
-        } 
+            line += to_string(label);
+            line += '\n';
+            csv << line;
+        }
+    }
+    if((csv.is_open() && !csv) || (binary.is_open() && !binary)) {
+        throw runtime_error("Failed writing the synthetic dataset");
+    }
+}
+
+
+// C++ source for applying an activation to the expression `x`, used by the code generator.
+string activationExpression(Activation activation, const string &x) {
+    switch(activation) {
+        case Activation::ReLU: return x + " > 0 ? " + x + " : 0";
+        case Activation::LeakyReLU: return x + " > 0 ? " + x + " : " + to_string(LeakyReluActivation::slope) + " * " + x;
+        case Activation::Tanh: return "std::tanh(" + x + ")";
+        case Activation::Sigmoid: return "1 / (1 + std::exp(-" + x + "))";
+        default: return x;
+    }
+}
 
-        for(size_t i =layers.size()-1; i>0; --i) {
-            for(size_t j =0; j<layers[i].neurons.size(); ++j) {
-                Neuron &neuron = layers[i].neurons[j];
-                double delta = (i==layers.size()-1 ? outputDeltas[j] : hiddenDeltas[i-1][j]);
+// Writes a self-contained header that computes the network's softmax output with the weights
+// baked in as constexpr arrays. The normalizer is folded into the first layer's weights and
+// biases, and every loop bound is a compile-time constant, so inference needs no allocation.
+void generateInferenceHeader(const NeuralNetwork &nn, const string &filename, const string &name) {
+    ofstream out(filename);
+    if(!out) {
+        throw runtime_error("Cannot write " + filename);
+    }
+    out.precision(17);
+    size_t inputSize = nn.inputSize();
+    size_t outputSize = nn.outputSize();
+
+    out << "// Generated by `neural_network codegen`. Do not edit.\n";
+    out << "#pragma once\n\n#include <cmath>\n#include <cstddef>\n\n";
+    out << "namespace " << name << " {\n\n";
+    out << "constexpr std::size_t inputSize = " << inputSize << ";\n";
+    out << "constexpr std::size_t outputSize = " << outputSize << ";\n\n";
 
-                for(size_t k=0; k<neuron.weights.size(); ++k) {
-                    neuron.weights[k] -= learningRate * delta * layers[i-1].neurons[k].value;
+    for(size_t l=0; l<nn.layers.size(); ++l) {
+        const Layer &layer = nn.layers[l];
+        bool foldNormalizer = l == 0 && nn.normalizer.fitted();
+        out << "alignas(64) constexpr double layer" << l << "Weights[" << layer.outputSize << "][" << layer.inputSize << "] = {\n";
+        for(size_t o=0; o<layer.outputSize; ++o) {
+            out << "    {";
+            for(size_t i=0; i<layer.inputSize; ++i) {
+                double weight = layer.weights[o * layer.inputSize + i];
+                if(foldNormalizer) {
+                    weight *= nn.normalizer.inverseStd[i];
+                }
+                out << (i ? ", " : "") << weight;
+            }
+            out << "},\n";
+        }
+        out << "};\n";
+        out << "alignas(64) constexpr double layer" << l << "Biases[" << layer.outputSize << "] = {";
+        for(size_t o=0; o<layer.outputSize; ++o) {
+            double bias = layer.biases[o];
+            if(foldNormalizer) {
+                for(size_t i=0; i<layer.inputSize; ++i) {
+                    bias -= layer.weights[o * layer.inputSize + i] * nn.normalizer.inverseStd[i] * nn.normalizer.mean[i];
                 }
-                neuron.bias -= learningRate * delta;
             }
+            out << (o ? ", " : "") << bias;
         }
+        out << "};\n\n";
     }
 
-    void train(const vector<vector<double>> &inputs, const vector<vector<double>> &targets, int epochs) {
-        for(int i=0; i<epochs; ++i) {
-            for(size_t j=0; j<inputs.size(); ++j) {
-                forwardPropagation(inputs[j]);
-                backProgpagation(targets[j]);
-            }
+    out << "// Writes the class probabilities for one raw (unnormalized) input row.\n";
+    out << "inline void infer(const double (&input)[" << inputSize << "], double (&probabilities)[" << outputSize << "]) {\n";
+    for(size_t l=0; l<nn.layers.size(); ++l) {
+        bool last = l == nn.layers.size() - 1;
+        size_t size = nn.layers[l].outputSize;
+        size_t in = nn.layers[l].inputSize;
+        string source = l == 0 ? "input" : "hidden" + to_string(l - 1);
+        string target = last ? "probabilities" : "hidden" + to_string(l);
+        if(!last) {
+            out << "    double " << target << "[" << size << "];\n";
         }
+        out << "    for(std::size_t o = 0; o < " << size << "; ++o) {\n";
+        out << "        double sum = layer" << l << "Biases[o];\n";
+        out << "        for(std::size_t i = 0; i < " << in << "; ++i) {\n";
+        out << "            sum += layer" << l << "Weights[o][i] * " << source << "[i];\n";
+        out << "        }\n";
+        out << "        " << target << "[o] = " << activationExpression(nn.layers[l].activation, "sum") << ";\n";
+        out << "    }\n";
     }
+    out << "    double maxLogit = probabilities[0];\n";
+    out << "    for(std::size_t o = 1; o < outputSize; ++o) {\n";
+    out << "        maxLogit = probabilities[o] > maxLogit ? probabilities[o] : maxLogit;\n";
+    out << "    }\n";
+    out << "    double expSum = 0;\n";
+    out << "    for(std::size_t o = 0; o < outputSize; ++o) {\n";
+    out << "        probabilities[o] = std::exp(probabilities[o] - maxLogit);\n";
+    out << "        expSum += probabilities[o];\n";
+    out << "    }\n";
+    out << "    for(std::size_t o = 0; o < outputSize; ++o) {\n";
+    out << "        probabilities[o] /= expSum;\n";
+    out << "    }\n";
+    out << "}\n\n";
 
-    int predict(const vector<double> &input) {
-        forwardPropagation(input);
+    out << "inline int predict(const double (&input)[" << inputSize << "]) {\n";
+    out << "    double probabilities[outputSize];\n";
+    out << "    infer(input, probabilities);\n";
+    out << "    int best = 0;\n";
+    out << "    for(std::size_t o = 1; o < outputSize; ++o) {\n";
+    out << "        best = probabilities[o] > probabilities[best] ? static_cast<int>(o) : best;\n";
+    out << "    }\n";
+    out << "    return best;\n";
+    out << "}\n\n";
+    out << "} // namespace " << name << "\n";
+}
+
+// Trains on a binary dataset without loading it into memory:
+//   neural_network stream <dataset.bin> [epochs] [chunkRows] [shuffleBufferRows]
+int runStreaming(int argc, char *argv[]) {
+    DatasetStream stream(argv[2], argc > 4 ? stoul(argv[4]) : 4096, argc > 5 ? stoul(argv[5]) : 65536);
+    int epochs = argc > 3 ? stoi(argv[3]) : 100;
+    cout << "Rows: " << stream.header.rowCount << ", stream buffers: " << stream.memoryBound() << " bytes" << endl;
+
+    NeuralNetwork nn({static_cast<int>(stream.header.featureCount), 5, static_cast<int>(stream.header.classCount)}, 0.01);
+    vector<double> input;
+    int label;
+    stream.beginEpoch();
+    while(stream.next(input, label)) {
+        nn.normalizer.update(input);
+    }
+    nn.normalizer.finalize();
+    nn.trainStreaming(stream, epochs);
 
-        return distance(layers.back().neurons.begin(), 
-            max_element(layers.back().neurons.begin(), layers.back().neurons.end(), 
-            [](const Neuron &a, const Neuron &b) { return a.value < b.value;}));
+    // One more pass to score the final weights, still within the same memory bound.
+    size_t correctPredictions = 0, rows = 0;
+    stream.beginEpoch();
+    while(stream.next(input, label)) {
+        correctPredictions += nn.predict(input) == label;
+        ++rows;
     }
+    cout << "Training accuracy: " << 100.0 * correctPredictions / max<size_t>(rows, 1) << "%" << endl;
+    return 0;
+}
 
-    double evaluateAccuracy(const vector<vector<double>> &inputs, const vector<vector<double>> &targets) {
-        int correctPredictions = 0;
-        for(size_t i=0; i<inputs.size(); ++i) {
-            forwardPropagation(inputs[i]);
+// Trains the iris network and optionally saves it. With a checkpoint file, training writes a
+// checkpoint every epoch and resumes from that file if it already exists:
+//   neural_network [train <model-out> [checkpoint]]
+int runIris(const string &modelFilename, const string &checkpointFilename) {
+    Dataset dataset = loadIrsihDataset("iris_dataset.csv");
+    // A resumed run has to see the same split, so checkpointed runs use a fixed seed.
+    mt19937 gen(checkpointFilename.empty() ? random_device{}() : 42);
+    auto [trainData, validationData] = splitDataset(dataset, 0.9, 0.1, gen);
+    cout << "Train size: " << trainData.size() << endl;
+    cout << "Validation size: " << validationData.size() << endl;
 
-            int predictedClass = distance(layers.back().neurons.begin(), 
-                max_element(layers.back().neurons.begin(), layers.back().neurons.end(), 
-                [](const Neuron &a, const Neuron &b) { return a.value < b.value;}));
-            
-            int actualClass = distance(targets.begin(), max_element(targets.begin(), targets.end()));
+    NeuralNetwork nn({4, 5, 3}, 0.01);
+    nn.normalizer = fitNormalizer(trainData);
+    TrainingOptions options;
+    options.epochs = 100;
+    options.schedule.type = LearningRateSchedule::Cosine;
+    options.schedule.warmupEpochs = 5;
+    options.validation = &validationData;
+    options.patience = 10;
 
-            if(predictedClass == actualClass) {
-                ++correctPredictions;
-            }
+    TrainingState state;
+    state.baseRate = nn.learningRate;
+    state.gen.seed(options.seed);
+    unique_ptr<AsyncCheckpointer> checkpointer;
+    if(!checkpointFilename.empty()) {
+        if(ifstream(checkpointFilename)) {
+            state = loadCheckpoint(checkpointFilename, nn);
+            cout << "Resuming from epoch " << state.epoch + 1 << ", step " << state.step << endl;
         }
+        checkpointer = make_unique<AsyncCheckpointer>(checkpointFilename);
+        options.checkpointEverySteps = trainData.size();
+        options.onCheckpoint = [&](const TrainingState &current) { checkpointer->submit(nn, current); };
+        checkpointer->reserve(nn.memoryPlanOptions(options, trainData.size()).checkpointBytes);
+    }
 
-        return static_cast<double>(correctPredictions) / inputs.size();
+    // Score a snapshot every few epochs in the background to get the accuracy curve, and stop
+    // once three snapshots in a row have not improved the validation loss.
+    AsyncValidator validator(nn, validationData, 3);
+    size_t snapshotEvery = max<size_t>(1, trainData.size() * 5);
+    TrainingReport report = nn.train(trainData, options, state, [&](size_t step) {
+        if(step % snapshotEvery == 0) {
+            validator.submit(step, nn.layers);
+        }
+        return !validator.shouldStop();
+    });
+    validator.finish();
+    if(checkpointer) {
+        checkpointer->finish();
+        cout << "Checkpoints written: " << checkpointer->written() << endl;
     }
+    for(const ValidationResult &result: validator.history()) {
+        cout << "Step " << result.step << ": validation loss " << result.loss << ", accuracy " << result.accuracy*100 << "%" << endl;
+    }
+    cout << "Epochs run: " << report.epochsRun << (report.stoppedEarly ? " (stopped early)" : "")
+        << ", best epoch: " << report.bestEpoch + 1 << ", best validation loss: " << report.bestValidationLoss << endl;
+    nn.evaluate(validationData).print(cout);
 
-};
+    for(size_t i =0; i<validationData.size(); ++i) {
+        cout << "ecpected output:" << validationData.label(i) << "\t";
+        cout << "predicted output:" << nn.predict(validationData.row(i)) << endl;
+    }
+
+    if(!modelFilename.empty()) {
+        nn.save(modelFilename);
+        cout << "Model saved to " << modelFilename << endl;
+    }
+    return 0;
+}
+
+// Seconds per row for single-row predictions, the request-path access pattern.
+double predictionLatency(NeuralNetwork &nn, const DatasetView &data, int repeats) {
+    int sink = 0;
+    auto start = chrono::steady_clock::now();
+    for(int r=0; r<repeats; ++r) {
+        for(size_t i=0; i<data.size(); ++i) {
+            sink += nn.predict(data.row(i));
+        }
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return sink >= 0 ? seconds / (repeats * max<size_t>(data.size(), 1)) : 0;
+}
 
-void loadIrsihDataset(const string &filename, vector<vector<double>> &trainInputs,
-    vector<vector<double>> &trainOutputs, vector<vector<double>> &validationsInputs,
-    vector<vector<double>> &validationOutputs, double trainSplit, double validationSplit) {
+// Distills a wide iris teacher into a small student and compares both, plus the same student
+// trained on hard labels only. The saved student can be compiled to a fixed-topology header
+// with `codegen`:
+//   neural_network distill [student-hidden] [temperature] [student-model-out]
+int runDistill(int argc, char *argv[]) {
+    int studentHidden = argc > 2 ? stoi(argv[2]) : 3;
+    DistillationOptions options;
+    options.temperature = argc > 3 ? stod(argv[3]) : 4;
+    Dataset dataset = loadIrsihDataset("iris_dataset.csv");
+    mt19937 gen(42);
+    auto [trainData, validationData] = splitDataset(dataset, 0.8, 0.2, gen);
 
+    NeuralNetwork teacher({4, 128, 128, 3}, 0.01);
+    teacher.normalizer = fitNormalizer(trainData);
+    TrainingOptions teacherOptions;
+    teacherOptions.epochs = 200;
+    teacherOptions.batchSize = 4;
+    teacherOptions.shuffle = true;
+    teacher.train(trainData, teacherOptions);
 
-        vector<vector<double>> inputs;
-        vector<vector<double>> outputs;
+    NeuralNetwork student({4, studentHidden, 3}, 0.05);
+    student.normalizer = teacher.normalizer;
+    NeuralNetwork baseline = student;
+    student.distill(teacher, trainData, options);
+    TrainingOptions baselineOptions;
+    baselineOptions.epochs = options.epochs;
+    baselineOptions.batchSize = options.batchSize;
+    baselineOptions.shuffle = true;
+    baseline.train(trainData, baselineOptions);
 
-        ifstream file(filename);
-        string line;
-        int lineNumber=0;
-    while (getline(file, line)) {
-        lineNumber++;
-        istringstream lineStream(line);
-        vector<double> input(4);
-        vector<double> output(3, 0);
+    double teacherAccuracy = teacher.evaluateAccuracy(validationData);
+    double studentAccuracy = student.evaluateAccuracy(validationData);
+    double teacherLatency = predictionLatency(teacher, validationData, 200);
+    double studentLatency = predictionLatency(student, validationData, 200);
+    cout << "Teacher: " << 100 * teacherAccuracy << "% accuracy, " << teacherLatency * 1e9 << " ns per prediction" << endl;
+    cout << "Student: " << 100 * studentAccuracy << "% accuracy, " << studentLatency * 1e9 << " ns per prediction" << endl;
+    cout << "Student without distillation: " << 100 * baseline.evaluateAccuracy(validationData) << "% accuracy" << endl;
+    cout << "Accuracy gap: " << 100 * (teacherAccuracy - studentAccuracy) << " points for a "
+         << teacherLatency / studentLatency << "x speedup" << endl;
+    if(argc > 4) {
+        student.save(argv[4]);
+        cout << "Student saved to " << argv[4] << endl;
+    }
+    return 0;
+}
 
-        for (size_t i = 0; i < 4; ++i) {
-            string value;
-            getline(lineStream, value, ',');
+// Evaluation throughput of free-floating threads sharing one model against threads pinned
+// round robin over NUMA nodes, each reading its node's replica:
+//   neural_network numa [threads] [rows] [width]
+int runNuma(int argc, char *argv[]) {
+    CpuTopology topology = CpuTopology::detect();
+    unsigned threadCount = argc > 2 ? stoul(argv[2]) : topology.cpuCount();
+    size_t rows = argc > 3 ? stoul(argv[3]) : 100000;
+    int width = argc > 4 ? stoi(argv[4]) : 256;
+    for(size_t node=0; node<topology.nodes.size(); ++node) {
+        cout << "Node " << node << ": " << topology.nodes[node].size() << " CPUs" << endl;
+    }
 
-            if (value.empty()) {
-                cerr << "Empty value found at line " << lineNumber << ", column " << (i + 1) << endl;
-                continue;
-            }
+    Dataset dataset;
+    dataset.featureCount = width;
+    dataset.classCount = 10;
+    mt19937 gen(1);
+    uniform_real_distribution<> feature(-1, 1);
+    vector<double> row(width);
+    for(size_t i=0; i<rows; ++i) {
+        generate(row.begin(), row.end(), [&]() { return feature(gen); });
+        dataset.addRow(row, i % 10);
+    }
+    DatasetView data(dataset);
+    NeuralNetwork nn({width, width, width, 10}, 0.01);
+    ReplicatedModel replicated(nn, topology);
 
-            try {
-                input[i] = stod(value);
-            } catch (const invalid_argument &e) {
-                cerr << "Invalid value found at line " << 
-                lineNumber << ", column " << (i + 1) << ": " << value << endl;
-                continue;
+    auto measure = [&](auto evaluate) {
+        auto start = chrono::steady_clock::now();
+        EvaluationReport report = evaluate();
+        return report.samples / chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    };
+    double unpinned = measure([&]() { return nn.evaluate(data, threadCount); });
+    double pinned = measure([&]() { return replicated.evaluate(data, threadCount); });
+    cout << "Unpinned, shared weights: " << unpinned << " rows/s" << endl;
+    cout << "Pinned, per-node weights: " << pinned << " rows/s (" << pinned / unpinned << "x)" << endl;
+    return 0;
+}
+
+// Trains on synthetic click-style data: a hashed user ID and a bag of tag IDs decide the class,
+// next to one dense noise feature. Training with a small and a large user table shows that the
+// step cost does not grow with the table:
+//   neural_network embedding [examples] [large-table-rows]
+int runEmbedding(int argc, char *argv[]) {
+    size_t examples = argc > 2 ? stoul(argv[2]) : 200000;
+    size_t largeRows = argc > 3 ? stoul(argv[3]) : size_t(1) << 22;
+    const int classCount = 4;
+    const size_t users = 5000, tags = 1000, batch = 32;
+
+    // Each user and each tag leans towards the classes by a random score vector; the label is the
+    // class with the highest user score plus mean tag score.
+    mt19937_64 gen(3);
+    normal_distribution<> score(0, 1);
+    vector<double> userScores(users * classCount), tagScores(tags * classCount);
+    generate(userScores.begin(), userScores.end(), [&]() { return score(gen); });
+    generate(tagScores.begin(), tagScores.end(), [&]() { return score(gen); });
+    vector<double> dense(examples);
+    vector<uint64_t> ids;
+    vector<uint32_t> offsets{0};
+    vector<int> labels(examples);
+    vector<double> classScores(classCount);
+    for(size_t e=0; e<examples; ++e) {
+        size_t user = gen() % users;
+        size_t tagCount = 1 + gen() % 4;
+        ids.push_back(user * 7919 + 1000000007);
+        offsets.push_back(ids.size());
+        copy_n(userScores.data() + user * classCount, classCount, classScores.begin());
+        for(size_t t=0; t<tagCount; ++t) {
+            size_t tag = gen() % tags;
+            ids.push_back(tag);
+            for(int c=0; c<classCount; ++c) {
+                classScores[c] += tagScores[tag * classCount + c] / tagCount;
             }
         }
+        offsets.push_back(ids.size());
+        dense[e] = uniform_real_distribution<>(-1, 1)(gen);
+        labels[e] = static_cast<int>(max_element(classScores.begin(), classScores.end()) - classScores.begin());
+    }
 
-        string label;
-        getline(lineStream, label);
-        if (label == "Iris-setosa") {
-            output[0] = 1;
-        } else if (label == "Iris-versicolor") {
-            output[1] = 1;
-        } else if (label == "Iris-virginica") {
-            output[2] = 1;
-        } else {
-            cerr << "Invalid label found at line " << lineNumber << ": " << label << endl;
-            continue;
+    for(size_t userRows: {size_t(1) << 16, largeRows}) {
+        EmbeddingLayer embeddings({{userRows, true, EmbeddingLayer::Pooling::Sum}, {tags, false, EmbeddingLayer::Pooling::Mean}}, 16, 0.1, 1);
+        EmbeddingNetwork model(move(embeddings), 1, {64}, classCount, 0.05);
+        size_t trainExamples = examples * 9 / 10;
+        auto start = chrono::steady_clock::now();
+        for(int epoch=0; epoch<3; ++epoch) {
+            for(size_t first=0; first+batch<=trainExamples; first+=batch) {
+                model.trainStep(dense.data() + first, ids.data(), offsets.data() + first * 2, labels.data() + first, batch);
+            }
         }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        size_t steps = 3 * (trainExamples / batch);
 
-        inputs.push_back(input);
-        outputs.push_back(output);
+        size_t correct = 0;
+        vector<int> predicted(batch);
+        size_t evaluated = 0;
+        for(size_t first=trainExamples; first+batch<=examples; first+=batch) {
+            model.predictBatch(dense.data() + first, ids.data(), offsets.data() + first * 2, batch, predicted.data());
+            for(size_t b=0; b<batch; ++b) {
+                correct += predicted[b] == labels[first + b];
+            }
+            evaluated += batch;
+        }
+        cout << "User table " << userRows << " rows (" << userRows * 16 * sizeof(double) / double(1 << 20) << " MiB): "
+             << seconds / steps * 1e6 << " us/step, held-out accuracy " << 100.0 * correct / max<size_t>(evaluated, 1) << "%" << endl;
     }
+    return 0;
+}
 
+// Replays skewed scoring traffic over a pool of distinct iris-like rows against an online model,
+// with and without the prediction cache, swapping the model halfway through:
+//   neural_network cache [requests] [distinct] [capacity]
+int runCache(int argc, char *argv[]) {
+    size_t requests = argc > 2 ? stoul(argv[2]) : 200000;
+    size_t distinct = argc > 3 ? stoul(argv[3]) : 5000;
+    size_t capacity = argc > 4 ? stoul(argv[4]) : 4096;
+    Dataset dataset = loadIrsihDataset("iris_dataset.csv");
+    DatasetView data(dataset);
+    NeuralNetwork nn({4, 128, 128, 3}, 0.01);
+    nn.normalizer = fitNormalizer(data);
+    TrainingOptions options;
+    options.epochs = 20;
+    options.shuffle = true;
+    nn.train(data, options);
 
-        vector<double> inputMeans(4,0);
-        vector<double> inputStds(4,0);
+    mt19937 gen(7);
+    normal_distribution<> jitter(0, 0.05);
+    vector<double> pool(distinct * 4);
+    for(size_t d=0; d<distinct; ++d) {
+        span<const double> row = data.row(d % data.size());
+        for(size_t j=0; j<4; ++j) {
+            pool[d * 4 + j] = row[j] + (d < data.size() ? 0 : jitter(gen));
+        }
+    }
+    // A few rows take most of the traffic: row = distinct * u^3 for uniform u.
+    uniform_real_distribution<> uniform(0, 1);
+    vector<double> traffic(requests * 4);
+    for(size_t r=0; r<requests; ++r) {
+        double u = uniform(gen);
+        size_t row = min(static_cast<size_t>(distinct * u * u * u), distinct - 1);
+        copy_n(pool.data() + row * 4, 4, traffic.data() + r * 4);
+    }
 
-        for(size_t i=0; i< inputs.size(); ++i) {
-            for(size_t j =0; j<inputs.size(); ++j)
-                inputMeans[j] += inputs[i][j];
+    PredictionCache cache(capacity);
+    Workspace workspace;
+    vector<int> uncached(requests), cached(requests);
+    const size_t batch = NeuralNetwork::inferenceBatch;
+    uint64_t versions = 0;
+    // Each replay gets its own online model, so both see the same sequence of model versions.
+    auto replay = [&](vector<int> &classIds, bool useCache) {
+        OnlineModel online(nn);
+        auto start = chrono::steady_clock::now();
+        for(size_t first=0; first<requests; first+=batch) {
+            size_t count = min(batch, requests - first);
+            if(first == requests / 2 / batch * batch) {
+                int label = data.label(0);
+                online.partialFit(data.row(0).data(), &label, 1);
+            }
+            online.readVersioned([&](const NeuralNetwork &model, uint64_t version) {
+                if(useCache) {
+                    cache.predictBatch(model, version, traffic.data() + first * 4, count, classIds.data() + first, workspace);
+                }
+                else {
+                    model.predictBatch(traffic.data() + first * 4, count, classIds.data() + first, workspace);
+                }
+            });
         }
-        
-            printf("burada1");
-        for(size_t i =0;i<inputMeans.size();++i)
-            inputMeans[i] /= inputs.size();
+        versions = online.version() + 1;
+        return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    };
+    double uncachedSeconds = replay(uncached, false);
+    double cachedSeconds = replay(cached, true);
+
+    size_t flopsPerRow = 0;
+    for(const Layer &layer: nn.layers) {
+        flopsPerRow += 2 * layer.weights.size();
+    }
+    cout << "Model versions served: " << versions << ", matching predictions: "
+         << (uncached == cached ? "all" : "MISMATCH") << endl;
+    cout << "Hit rate: " << 100 * cache.hitRate() << "% (" << cache.hitCount() << " hits, " << cache.missCount() << " misses)" << endl;
+    cout << "Saved compute: " << cache.hitCount() * flopsPerRow / 1e6 << " MFLOP" << endl;
+    cout << "Uncached: " << requests / uncachedSeconds << " predictions/s, cached: " << requests / cachedSeconds
+         << " predictions/s (" << uncachedSeconds / cachedSeconds << "x)" << endl;
+    return 0;
+}
+
+// Trains several iris networks and compares predicting with each member in turn against the
+// fused ensemble:
+//   neural_network ensemble [members] [hidden]
+int runEnsemble(int argc, char *argv[]) {
+    size_t memberCount = argc > 2 ? stoul(argv[2]) : 5;
+    int hidden = argc > 3 ? stoi(argv[3]) : 256;
+    Dataset dataset = loadIrsihDataset("iris_dataset.csv");
+    mt19937 gen(42);
+    auto [trainData, validationData] = splitDataset(dataset, 0.8, 0.2, gen);
+
+    vector<NeuralNetwork> members;
+    TrainingOptions options;
+    options.epochs = 30;
+    options.batchSize = 4;
+    options.shuffle = true;
+    for(size_t m=0; m<memberCount; ++m) {
+        members.emplace_back(vector<int>{4, hidden, hidden, 3}, 0.01);
+        members.back().normalizer = fitNormalizer(trainData);
+        members.back().train(trainData, options);
+    }
+    Ensemble ensemble(members);
 
-        for(size_t i=0; i< inputs.size(); ++i) {
-            for(size_t j =0; j<inputs.size(); ++j)
-                inputStds[j] += pow(inputs[i][j] - inputMeans[j], 2);
+    size_t rows = validationData.size();
+    vector<double> inputs(rows * 4);
+    for(size_t i=0; i<rows; ++i) {
+        copy_n(validationData.row(i).data(), 4, inputs.data() + i * 4);
+    }
+    Workspace workspace;
+    vector<double> separate(rows * 3), fused(rows * 3);
+    int repeats = 50;
+    auto start = chrono::steady_clock::now();
+    for(int r=0; r<repeats; ++r) {
+        fill(separate.begin(), separate.end(), 0.0);
+        for(const NeuralNetwork &member: members) {
+            for(size_t first=0; first<rows; first+=NeuralNetwork::inferenceBatch) {
+                size_t batch = min(NeuralNetwork::inferenceBatch, rows - first);
+                member.forward(inputs.data() + first * 4, batch, workspace);
+                for(size_t k=0; k<batch * 3; ++k) {
+                    separate[first * 3 + k] += workspace.activations.back()[k] / memberCount;
+                }
+            }
         }
+    }
+    double separateSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    start = chrono::steady_clock::now();
+    for(int r=0; r<repeats; ++r) {
+        for(size_t first=0; first<rows; first+=NeuralNetwork::inferenceBatch) {
+            size_t batch = min(NeuralNetwork::inferenceBatch, rows - first);
+            ensemble.predictProbabilities(inputs.data() + first * 4, batch, fused.data() + first * 3, workspace);
+        }
+    }
+    double fusedSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    double difference = 0;
+    size_t correct = 0;
+    vector<int> classIds(rows);
+    ensemble.predictBatch(inputs.data(), rows, classIds.data(), workspace);
+    for(size_t i=0; i<rows; ++i) {
+        correct += classIds[i] == validationData.label(i);
+    }
+    for(size_t k=0; k<fused.size(); ++k) {
+        difference = max(difference, abs(fused[k] - separate[k]));
+    }
+    for(size_t m=0; m<memberCount; ++m) {
+        cout << "Member " << m << " accuracy: " << 100 * members[m].evaluateAccuracy(validationData) << "%" << endl;
+    }
+    cout << "Ensemble accuracy: " << 100.0 * correct / rows << "%" << endl;
+    cout << "Members one by one: " << separateSeconds / (repeats * rows) * 1e6 << " us per row" << endl;
+    cout << "Fused ensemble: " << fusedSeconds / (repeats * rows) * 1e6 << " us per row ("
+         << separateSeconds / fusedSeconds << "x), max probability difference " << difference << endl;
+    return 0;
+}
+
+// Streams the iris training rows as small events into an OnlineModel while reader threads keep
+// predicting on the validation rows:
+//   neural_network online [passes] [readers]
+int runOnline(int argc, char *argv[]) {
+    int passes = argc > 2 ? stoi(argv[2]) : 50;
+    int readerCount = argc > 3 ? stoi(argv[3]) : 2;
+    Dataset dataset = loadIrsihDataset("iris_dataset.csv");
+    mt19937 gen(random_device{}());
+    auto [trainData, validationData] = splitDataset(dataset, 0.9, 0.1, gen);
+
+    OnlineModel model(NeuralNetwork({4, 5, 3}, 0.1), 64);
+    model.replaySamplesPerUpdate = 4;
+    atomic<bool> done{false};
+    atomic<size_t> predictions{0};
+    vector<thread> readers;
+    for(int r=0; r<readerCount; ++r) {
+        readers.emplace_back([&]() {
+            Workspace workspace;
+            int classId;
+            for(size_t i=0; !done.load(memory_order_relaxed); i = (i + 1) % validationData.size()) {
+                model.read([&](const NeuralNetwork &nn) {
+                    nn.predictBatch(validationData.row(i).data(), 1, &classId, workspace);
+                });
+                predictions.fetch_add(1, memory_order_relaxed);
+            }
+        });
+    }
 
-        for(size_t i =0;i<inputStds.size();++i)
-            inputStds[i] = sqrt(inputStds[i] / inputs.size());
-        
-            printf("burada2");
-        for(size_t i=0; i< inputs.size(); ++i) {
-            for(size_t j =0; j<inputs.size(); ++j)
-                inputs[i][j] = (inputs[i][j] - inputMeans[j]) / inputStds[j];
+    const size_t eventSize = 16;
+    vector<double> inputs;
+    vector<int> labels;
+    for(int pass=0; pass<passes; ++pass) {
+        trainData.shuffle(gen);
+        for(size_t first=0; first<trainData.size(); first+=eventSize) {
+            inputs.clear();
+            labels.clear();
+            for(size_t i=first; i<min(first + eventSize, trainData.size()); ++i) {
+                inputs.insert(inputs.end(), trainData.row(i).begin(), trainData.row(i).end());
+                labels.push_back(trainData.label(i));
+            }
+            model.partialFit(inputs.data(), labels.data(), labels.size());
         }
-        
-            printf("burada3");
-        random_device rd;
-        mt19937 g(rd());
-        vector<size_t> indices(inputs.size());
-        iota(indices.begin(), indices.end() , 0);
+    }
+    done = true;
+    for(thread &reader: readers) {
+        reader.join();
+    }
 
-        shuffle(indices.begin(), indices.end(),g);
+    Workspace workspace;
+    size_t correctPredictions = 0;
+    model.read([&](const NeuralNetwork &nn) {
+        for(size_t i=0; i<validationData.size(); ++i) {
+            int classId;
+            nn.predictBatch(validationData.row(i).data(), 1, &classId, workspace);
+            correctPredictions += classId == validationData.label(i);
+        }
+    });
+    cout << "Published versions: " << model.version() << ", concurrent predictions served: " << predictions.load() << endl;
+    cout << "Accuracy: " << 100.0 * correctPredictions / validationData.size() << "%" << endl;
+    return 0;
+}
 
-        size_t trainsize = static_cast<size_t>(inputs.size() * trainSplit);
-        size_t validationSize = static_cast<size_t>(inputs.size() * validationSplit);
+// Hardware counters around single-sample forwardPropagation and backProgpagation calls and a
+// full training epoch over the benchmark inputs.
+void benchmarkCounters(NeuralNetwork &nn, const vector<double> &inputs, const vector<int> &labels) {
+    PerfCounters counters;
+    if(!counters.available()) {
+        cout << "Hardware counters unavailable (" << counters.unavailableReason() << "), skipping counter report" << endl;
+        return;
+    }
+    size_t width = nn.inputSize();
+    size_t rows = inputs.size() / width;
+    const int repeats = 20;
 
-        for(size_t i=0; i< trainsize; ++i) {
-            trainInputs.push_back(inputs[indices[i]]);
-            trainOutputs.push_back(outputs[indices[i]]);
+    counters.reset();
+    for(int r=0; r<repeats; ++r) {
+        for(size_t i=0; i<rows; ++i) {
+            counters.enable();
+            nn.forwardPropagation(span<const double>(inputs.data() + i * width, width));
+            counters.disable();
+            nn.backProgpagation(labels[i] % nn.outputSize());
+        }
+    }
+    PerfCounters::Sample forward = counters.read();
+    counters.reset();
+    for(int r=0; r<repeats; ++r) {
+        for(size_t i=0; i<rows; ++i) {
+            nn.forwardPropagation(span<const double>(inputs.data() + i * width, width));
+            counters.enable();
+            nn.backProgpagation(labels[i] % nn.outputSize());
+            counters.disable();
         }
-        for(size_t i=trainsize; i< trainsize + validationSize; ++i) {
-            validationsInputs.push_back(inputs[indices[i]]);
-            validationOutputs.push_back(outputs[indices[i]]);
+    }
+    PerfCounters::Sample backward = counters.read();
+
+    Dataset dataset;
+    dataset.featureCount = width;
+    dataset.classCount = nn.outputSize();
+    for(int r=0; r<repeats; ++r) {
+        for(size_t i=0; i<rows; ++i) {
+            dataset.addRow(span<const double>(inputs.data() + i * width, width), labels[i] % nn.outputSize());
         }
+    }
+    TrainingOptions options;
+    options.epochs = 1;
+    options.batchSize = rows;
+    counters.reset();
+    counters.enable();
+    nn.train(DatasetView(dataset), options);
+    counters.disable();
+    PerfCounters::Sample epoch = counters.read();
 
-        cout << "Train size: " << trainInputs.size() << endl;
-        cout << "Validation size: " << validationsInputs.size() << endl;
+    PerfCounters::print(cout, "forwardPropagation", forward, repeats * rows);
+    PerfCounters::print(cout, "backProgpagation", backward, repeats * rows);
+    PerfCounters::print(cout, "epoch, batch " + to_string(rows), epoch, dataset.size());
 }
 
+// Times batched inference on a synthetic network with double and bfloat16 weights; `perf` adds
+// a hardware counter report:
+//   neural_network benchmark [width] [depth] [batch] [perf]
+int runBenchmark(int argc, char *argv[]) {
+    int width = argc > 2 ? stoi(argv[2]) : 1024;
+    int depth = argc > 3 ? stoi(argv[3]) : 4;
+    size_t batch = argc > 4 ? stoul(argv[4]) : 32;
+    vector<int> layerSizes(depth + 1, width);
+    layerSizes.push_back(10);
+    NeuralNetwork nn(layerSizes, 0.01);
 
-int main() {
-    vector<vector<double>> trainInputs, trainOutputs, validationInputs, validationOutputs;
-    loadIrsihDataset("iris_dataset.csv", trainInputs, trainOutputs, validationInputs, validationOutputs, 0.9, 0.1);
+    mt19937 gen(42);
+    normal_distribution<> dis(0, 1);
+    vector<double> inputs(batch * width);
+    generate(inputs.begin(), inputs.end(), [&](){ return dis(gen); });
 
-    NeuralNetwork nn({4, 5, 3}, 0.01);
-    nn.train(trainInputs, trainOutputs, 100);
-    double accuracy = nn.evaluateAccuracy(validationInputs, validationOutputs);
-    cout << "Accuracy: " << accuracy*100 << "%" << endl;
+    Workspace workspace;
+    auto timeForward = [&](const char *name) {
+        nn.forward(inputs.data(), batch, workspace);
+        int iterations = 0;
+        auto start = chrono::steady_clock::now();
+        chrono::duration<double> elapsed{};
+        do {
+            nn.forward(inputs.data(), batch, workspace);
+            ++iterations;
+            elapsed = chrono::steady_clock::now() - start;
+        } while(elapsed.count() < 1.0);
+        double seconds = elapsed.count() / iterations;
+        cout << name << ": " << nn.weightBytes() / double(1 << 20) << " MiB weights, " << seconds * 1e3 << " ms/batch, "
+            << batch / seconds << " samples/s" << endl;
+    };
+
+    cout << "Network: " << depth << " hidden layers of " << width << ", batch " << batch << endl;
+    timeForward("double weights");
+    nn.useBFloat16Weights(true);
+    timeForward("bfloat16 weights");
+    nn.useBFloat16Weights(false);
+
+    // Training steps with all activations resident versus checkpoints every sqrt(depth) layers.
+    vector<int> labels(batch);
+    generate(labels.begin(), labels.end(), [&](){ return static_cast<int>(gen() % 10); });
+    auto timeTraining = [&](const char *name, size_t interval) {
+        nn.checkpointActivations(interval);
+        Workspace trainingWorkspace;
+        int iterations = 0;
+        auto start = chrono::steady_clock::now();
+        chrono::duration<double> elapsed{};
+        do {
+            nn.forward(inputs.data(), batch, trainingWorkspace);
+            nn.backward(labels.data(), trainingWorkspace);
+            ++iterations;
+            elapsed = chrono::steady_clock::now() - start;
+        } while(elapsed.count() < 1.0);
+        cout << name << ": " << trainingWorkspace.peakActivationBytes / double(1 << 20) << " MiB peak activations, "
+            << elapsed.count() / iterations * 1e3 << " ms/step" << endl;
+    };
+    timeTraining("training, all activations", 0);
+    timeTraining("training, checkpointed", max<size_t>(static_cast<size_t>(sqrt(depth + 1)), 1));
+    nn.checkpointActivations(0);
+    nn.useBFloat16Weights(true);
+    timeTraining("training, bfloat16 weights", 0);
+    nn.useBFloat16Weights(false);
+
+    // Training steps against a 20000-class output layer with the full and the sampled softmax.
+    const int classCount = 20000;
+    const size_t sampleCount = 64;
+    NeuralNetwork wide({width, 256, classCount}, 0.01);
+    generate(labels.begin(), labels.end(), [&](){ return static_cast<int>(gen() % classCount); });
+    LogUniformSampler sampler(classCount);
+    auto timeOutput = [&](const char *name, bool sampled) {
+        Workspace trainingWorkspace;
+        int iterations = 0;
+        auto start = chrono::steady_clock::now();
+        chrono::duration<double> elapsed{};
+        do {
+            if(sampled) {
+                wide.sampledSoftmaxStep(inputs.data(), labels.data(), batch, sampleCount, sampler, gen, trainingWorkspace);
+            }
+            else {
+                wide.forward(inputs.data(), batch, trainingWorkspace);
+                wide.backward(labels.data(), trainingWorkspace);
+            }
+            ++iterations;
+            elapsed = chrono::steady_clock::now() - start;
+        } while(elapsed.count() < 1.0);
+        cout << name << ": " << elapsed.count() / iterations * 1e3 << " ms/step" << endl;
+    };
+    timeOutput("20000 classes, full softmax", false);
+    timeOutput("20000 classes, sampled softmax (64)", true);
+
+    vector<int> topClasses(batch * 10);
+    vector<double> topProbabilities(batch * 10);
+    MemoryPlanOptions topKOptions;
+    topKOptions.inferenceOnly = true;
+    topKOptions.topK = 10;
+    Workspace topKWorkspace;
+    wide.reserveWorkspace(topKWorkspace, planMemory(wide.layerSizes(), NeuralNetwork::inferenceBatch, topKOptions));
+    int iterations = 0;
+    auto start = chrono::steady_clock::now();
+    chrono::duration<double> elapsed{};
+    do {
+        wide.predictTopK(inputs.data(), batch, 10, topClasses.data(), topProbabilities.data(), topKWorkspace);
+        ++iterations;
+        elapsed = chrono::steady_clock::now() - start;
+    } while(elapsed.count() < 1.0);
+    cout << "20000 classes, top-10 predictions: " << iterations * batch / elapsed.count() << " samples/s" << endl;
+    if(argc > 5 && string(argv[5]) == "perf") {
+        benchmarkCounters(nn, inputs, labels);
+    }
+    return 0;
+}
 
-    for(size_t i =0; i<validationInputs.size(); ++i) {
-        cout << "ecpected output:" << distance(validationOutputs[i].begin(), max_element(validationOutputs[i].begin(), validationOutputs[i].end())) << "\t";
-        cout << "predicted output:" << nn.predict(validationInputs[i]) << endl;
+// Prints the memory plan of a training configuration without allocating it:
+//   neural_network plan <input,hidden...,output> [batch] [checkpoint-interval] [double|bf16] [sampled-classes]
+int runPlan(int argc, char *argv[]) {
+    vector<int> layerSizes;
+    istringstream sizes(argv[2]);
+    string size;
+    while(getline(sizes, size, ',')) {
+        layerSizes.push_back(stoi(size));
     }
+    if(layerSizes.size() < 2) {
+        throw runtime_error("Need at least an input and an output size, e.g. 784,256,10");
+    }
+    size_t batch = argc > 3 ? stoul(argv[3]) : 1;
+    MemoryPlanOptions options;
+    options.checkpointInterval = argc > 4 ? stoul(argv[4]) : 0;
+    options.bfloat16Weights = argc > 5 && string(argv[5]) == "bf16";
+    options.sampledSoftmaxClasses = argc > 6 ? stoul(argv[6]) : 0;
+    planMemory(layerSizes, batch, options).print(cout);
+    return 0;
+}
+
+// Evaluates a saved model on a binary or numeric CSV dataset:
+//   neural_network evaluate <model> <bin|csv> [threads]
+int runEvaluate(int argc, char *argv[]) {
+    NeuralNetwork nn = NeuralNetwork::load(argv[2]);
+    Dataset dataset = loadDataset(argv[3]);
+    if(dataset.featureCount != nn.inputSize() || dataset.classCount > nn.outputSize()) {
+        throw runtime_error("Dataset does not match the model's input or output size");
+    }
+    unsigned threads = argc > 4 ? stoul(argv[4]) : thread::hardware_concurrency();
+    auto start = chrono::steady_clock::now();
+    EvaluationReport report = nn.evaluate(DatasetView(dataset), threads);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    report.print(cout);
+    cout << "Evaluated " << report.samples << " rows in " << seconds << " s" << endl;
+    return 0;
+}
+
+// Generates a synthetic dataset for load and scaling tests; pass - to skip an output:
+//   neural_network generate <rows> <features> <classes> <csv|-> <bin|-> [sparsity] [noise] [seed]
+int runGenerate(int argc, char *argv[]) {
+    SyntheticDatasetOptions options;
+    options.rows = stoull(argv[2]);
+    options.featureCount = stoul(argv[3]);
+    options.classCount = stoul(argv[4]);
+    options.sparsity = argc > 7 ? stod(argv[7]) : 0;
+    options.noise = argc > 8 ? stod(argv[8]) : 1;
+    options.seed = argc > 9 ? stoul(argv[9]) : 1;
+    if(options.featureCount == 0 || options.classCount == 0 || options.classCount > 65536) {
+        throw runtime_error("Need at least one feature and between 1 and 65536 classes");
+    }
+    string csvFilename = argv[5], binaryFilename = argv[6];
+    auto start = chrono::steady_clock::now();
+    generateSyntheticDataset(options, csvFilename == "-" ? "" : csvFilename, binaryFilename == "-" ? "" : binaryFilename);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << "Generated " << options.rows << " rows in " << seconds << " s" << endl;
+    return 0;
+}
+
+// Trains a one-hidden-layer network on a binary or numeric CSV dataset, such as one written by
+// generate, and reports throughput and validation metrics; pass - to skip saving the model:
+//   neural_network fit <bin|csv> <model-out|-> [hidden] [epochs] [batch]
+int runFit(int argc, char *argv[]) {
+    auto start = chrono::steady_clock::now();
+    Dataset dataset = loadDataset(argv[2]);
+    double loadSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    if(dataset.size() == 0) {
+        throw runtime_error("Empty dataset: " + string(argv[2]));
+    }
+    int hidden = argc > 4 ? stoi(argv[4]) : 64;
+    mt19937 gen(42);
+    auto [trainData, validationData] = splitDataset(dataset, 0.9, 0.1, gen);
+    cout << "Loaded " << dataset.size() << " rows of " << dataset.featureCount << " features, " << dataset.classCount
+        << " classes in " << loadSeconds << " s" << endl;
+
+    NeuralNetwork nn({static_cast<int>(dataset.featureCount), hidden, static_cast<int>(dataset.classCount)}, 0.01);
+    nn.normalizer = fitNormalizer(trainData);
+    TrainingOptions options;
+    options.epochs = argc > 5 ? stoi(argv[5]) : 5;
+    options.batchSize = argc > 6 ? stoul(argv[6]) : 32;
+    options.shuffle = true;
+    options.seed = 42;
+    start = chrono::steady_clock::now();
+    nn.train(trainData, options);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << "Trained " << options.epochs << " epochs in " << seconds << " s, " << options.epochs * trainData.size() / seconds
+        << " rows/s" << endl;
+
+    start = chrono::steady_clock::now();
+    EvaluationReport report = nn.evaluate(validationData);
+    seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    report.print(cout);
+    cout << "Evaluated " << report.samples << " rows in " << seconds << " s" << endl;
+    if(string(argv[3]) != "-") {
+        nn.save(argv[3]);
+        cout << "Model saved to " << argv[3] << endl;
+    }
+    return 0;
+}
+
+// One data-parallel worker: trains a replica on every `workers`-th row of the iris training
+// split. Replicas start from rank 0's random initialization and stay identical
+// because every step applies the same all-reduced gradient. Each layer's gradient is handed to
+// the ring as soon as backpropagation finishes it, overlapping its communication with the
+// gradients of the layers below.
+int runDataParallelWorker(int rank, int workers, int sendFd, int receiveFd, int epochs, size_t batchSize, int hidden) {
+    Dataset dataset = loadIrsihDataset("iris_dataset.csv");
+    mt19937 gen(42);
+    auto [trainData, validationData] = splitDataset(dataset, 0.9, 0.1, gen);
+    NeuralNetwork nn({4, hidden, 3}, 0.05);
+    nn.normalizer = fitNormalizer(trainData);
+    RingAllReduce ring(rank, workers, sendFd, receiveFd);
+    // Broadcast rank 0's initialization: the other ranks contribute zeros to the sum.
+    for(Layer &layer: nn.layers) {
+        if(rank != 0) {
+            fill(layer.weights.begin(), layer.weights.end(), 0.0);
+            fill(layer.biases.begin(), layer.biases.end(), 0.0);
+        }
+        ring.sum(layer.weights.data(), layer.weights.size());
+        ring.sum(layer.biases.data(), layer.biases.size());
+    }
+
+    // Equal shards and whole batches keep every rank on the same number of collective steps.
+    DatasetView shard = trainData;
+    size_t shardRows = trainData.size() / workers;
+    shard.indices.clear();
+    for(size_t i=0; i<shardRows; ++i) {
+        shard.indices.push_back(trainData.indices[i * workers + rank]);
+    }
+    batchSize = clamp<size_t>(batchSize, 1, max<size_t>(shardRows, 1));
+    size_t steps = shardRows / batchSize;
+    mt19937 shardGen(1000 + rank);
+
+    Workspace workspace;
+    vector<double> batchInputs(batchSize * nn.inputSize());
+    vector<int> batchLabels(batchSize);
+    double waitSeconds = 0;
+    auto start = chrono::steady_clock::now();
+    for(int epoch=0; epoch<epochs; ++epoch) {
+        shard.shuffle(shardGen);
+        for(size_t step=0; step<steps; ++step) {
+            for(size_t b=0; b<batchSize; ++b) {
+                copy_n(shard.row(step * batchSize + b).data(), nn.inputSize(), batchInputs.data() + b * nn.inputSize());
+                batchLabels[b] = shard.label(step * batchSize + b);
+            }
+            nn.computeGradients(batchInputs.data(), batchLabels.data(), batchSize, workspace,
+                [&](size_t l) { ring.sumAsync(workspace.gradients[l]); });
+            auto waitStart = chrono::steady_clock::now();
+            ring.wait();
+            waitSeconds += chrono::duration<double>(chrono::steady_clock::now() - waitStart).count();
+            nn.applyGradients(workspace, nn.learningRate / (batchSize * workers));
+        }
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
 
+    double checksum = 0;
+    for(const Layer &layer: nn.layers) {
+        checksum = accumulate(layer.weights.begin(), layer.weights.end(), checksum);
+    }
+    ostringstream line;
+    line.precision(17);
+    line << "Rank " << rank << ": " << epochs * steps * batchSize / seconds << " samples/s, communication "
+         << ring.communicationSeconds() << " s (" << waitSeconds << " s not overlapped), "
+         << ring.sentBytes() << " bytes sent, weight checksum " << checksum << "\n";
+    if(rank == 0) {
+        line << "Validation accuracy: " << 100 * nn.evaluateAccuracy(validationData) << "%\n";
+    }
+    cout << line.str() << flush;
     return 0;
-    
-}
\ No newline at end of file
+}
+
+// Data-parallel training across worker processes on this machine:
+//   neural_network launch <workers> [epochs] [batch] [hidden] [pin]
+// Worker r sends to worker r + 1 over a Unix domain socket pair, closing the ring. With `pin`,
+// worker r is pinned to a CPU before it allocates anything, spreading workers over NUMA nodes.
+int runLaunch(int argc, char *argv[]) {
+    int workers = max(stoi(argv[2]), 1);
+    int epochs = argc > 3 ? stoi(argv[3]) : 100;
+    size_t batchSize = argc > 4 ? stoul(argv[4]) : 4;
+    int hidden = argc > 5 ? stoi(argv[5]) : 5;
+    bool pin = argc > 6 && string(argv[6]) == "pin";
+    CpuTopology topology = CpuTopology::detect();
+
+    vector<array<int, 2>> links(workers);
+    for(array<int, 2> &link: links) {
+        if(socketpair(AF_UNIX, SOCK_STREAM, 0, link.data()) != 0) {
+            throw runtime_error(string("socketpair failed: ") + strerror(errno));
+        }
+    }
+    cout << flush;
+    vector<pid_t> children;
+    for(int rank=0; rank<workers; ++rank) {
+        pid_t pid = fork();
+        if(pid < 0) {
+            throw runtime_error(string("fork failed: ") + strerror(errno));
+        }
+        if(pid == 0) {
+            int sendFd = links[rank][0];
+            int receiveFd = links[(rank + workers - 1) % workers][1];
+            for(const array<int, 2> &link: links) {
+                for(int fd: link) {
+                    if(fd != sendFd && fd != receiveFd) {
+                        close(fd);
+                    }
+                }
+            }
+            if(pin) {
+                pinCurrentThread(topology.cpuForThread(rank));
+            }
+            int result = 1;
+            try {
+                result = runDataParallelWorker(rank, workers, sendFd, receiveFd, epochs, batchSize, hidden);
+            }
+            catch(const exception &e) {
+                cerr << "Rank " << rank << ": " << e.what() << endl;
+            }
+            _exit(result);
+        }
+        children.push_back(pid);
+    }
+    for(const array<int, 2> &link: links) {
+        close(link[0]);
+        close(link[1]);
+    }
+
+    int failures = 0;
+    for(pid_t pid: children) {
+        int status = 0;
+        waitpid(pid, &status, 0);
+        failures += !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+    }
+    return failures == 0 ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) {
+    if(argc > 3 && string(argv[1]) == "convert") {
+        convertIrisCsvToBinary(argv[2], argv[3]);
+        return 0;
+    }
+    if(argc > 2 && string(argv[1]) == "plan") {
+        return runPlan(argc, argv);
+    }
+    if(argc > 3 && string(argv[1]) == "evaluate") {
+        return runEvaluate(argc, argv);
+    }
+    if(argc > 3 && string(argv[1]) == "fit") {
+        return runFit(argc, argv);
+    }
+    if(argc > 6 && string(argv[1]) == "generate") {
+        return runGenerate(argc, argv);
+    }
+    if(argc > 2 && string(argv[1]) == "stream") {
+        return runStreaming(argc, argv);
+    }
+    if(argc > 1 && string(argv[1]) == "online") {
+        return runOnline(argc, argv);
+    }
+    if(argc > 1 && string(argv[1]) == "embedding") {
+        return runEmbedding(argc, argv);
+    }
+    if(argc > 1 && string(argv[1]) == "cache") {
+        return runCache(argc, argv);
+    }
+    if(argc > 1 && string(argv[1]) == "numa") {
+        return runNuma(argc, argv);
+    }
+    if(argc > 1 && string(argv[1]) == "ensemble") {
+        return runEnsemble(argc, argv);
+    }
+    if(argc > 1 && string(argv[1]) == "distill") {
+        return runDistill(argc, argv);
+    }
+    if(argc > 2 && string(argv[1]) == "launch") {
+        return runLaunch(argc, argv);
+    }
+    if(argc > 1 && string(argv[1]) == "benchmark") {
+        return runBenchmark(argc, argv);
+    }
+    if(argc > 3 && string(argv[1]) == "codegen") {
+        generateInferenceHeader(NeuralNetwork::load(argv[2]), argv[3], argc > 4 ? argv[4] : "model");
+        return 0;
+    }
+    bool train = argc > 2 && string(argv[1]) == "train";
+    return runIris(train ? argv[2] : "", train && argc > 3 ? argv[3] : "");
+}
@@ -14,6 +14,10 @@
 #include <utility>
 #include<cstdlib>
 #include <algorithm>
+#include <array>
+#include <memory>
+#include <climits>
+#include <atomic>
 #include<iostream>
 #include<fstream>
 using namespace std;
@@ -23,16 +27,90 @@ int generations = 1000; //number of generations to run default is 1000
 int	mutation_rate = 15; //mutation rate in percent
 bool show_population_in_terminal = false; //its very large so it is not recommended to use it
 bool save_population_in_file = false; //its very large so it is not recommended to use it
-int originalGraph[10000][10000];  //original graph maximum size is 10000x10000
-int points[10000][2],total_cities;
+vector<array<int, 2>> points; //coordinates of the cities
+int total_cities;
 vector<pair<vector<int>, int> >population;
 
 
+uint64_t random_seed = 0; //seed of the random numbers, 0 means a different seed on every start
+
+//xoshiro256** generator: a few shifts and xors per number instead of mersenne twister's 2.5 KB state,
+//it also works as the generator of std::shuffle
+class Xoshiro256
+{
+public:
+    using result_type = uint64_t;
+    explicit Xoshiro256(uint64_t seed)
+    {
+        for(auto& word : state) //splitmix64 spreads the seed over the whole state
+        {
+            seed += 0x9e3779b97f4a7c15;
+            uint64_t z = seed;
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+            word = z ^ (z >> 31);
+        }
+    }
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return UINT64_MAX; }
+    result_type operator()()
+    {
+        uint64_t result = rotl(state[1] * 5, 7) * 9;
+        uint64_t t = state[1] << 17;
+        state[2] ^= state[0];
+        state[3] ^= state[1];
+        state[1] ^= state[2];
+        state[0] ^= state[3];
+        state[2] ^= t;
+        state[3] = rotl(state[3], 45);
+        return result;
+    }
+    uint32_t bounded(uint32_t upperbound) //unbiased number between 0 and upperbound-1 with Lemire's multiply and reject method
+    {
+        uint64_t m = uint64_t(uint32_t((*this)() >> 32)) * upperbound;
+        if(uint32_t(m) < upperbound) //only the low values can be biased, reject the few extra ones
+        {
+            uint32_t threshold = -upperbound % upperbound;
+            while(uint32_t(m) < threshold)
+                m = uint64_t(uint32_t((*this)() >> 32)) * upperbound;
+        }
+        return uint32_t(m >> 32);
+    }
+    void jump() //advances the generator by 2^128 numbers, so streams that jumped a different number of times never overlap
+    {
+        static constexpr uint64_t polynomial[] = {0x180ec6d33cfd0aba, 0xd5a61266f0c9392c, 0xa9582618e03fc9aa, 0x39abdc4529b1661c};
+        uint64_t jumped[4] = {0, 0, 0, 0};
+        for(uint64_t word : polynomial)
+            for(int bit = 0; bit < 64; bit++)
+            {
+                if(word & (uint64_t(1) << bit))
+                    for(int i = 0; i < 4; i++)
+                        jumped[i] ^= state[i];
+                (*this)();
+            }
+        for(int i = 0; i < 4; i++)
+            state[i] = jumped[i];
+    }
+private:
+    uint64_t state[4];
+    static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+};
+
+Xoshiro256& randomEngine() //the generator of the calling thread, every thread gets its own stream of the same seed
+{
+    static atomic<int> streams{0};
+    thread_local Xoshiro256 engine = [] {
+        static const uint64_t seed = random_seed != 0 ? random_seed : (uint64_t(random_device()()) << 32) ^ random_device()();
+        Xoshiro256 generator(seed);
+        for(int i = streams++; i > 0; i--) //the n-th thread jumps n times
+            generator.jump();
+        return generator;
+    }();
+    return engine;
+}
+
 int generateRandomNumber(int upperbound) {  //generate random number between 0 and upperbound
-    random_device rd; //Will be used to obtain a seed for the random number engine
-    mt19937 gen(rd()); //Standard mersenne_twister_engine seeded with rd()
-    uniform_int_distribution<> dis(0, upperbound - 1);
-    return dis(gen); //return random number
+    return int(randomEngine().bounded(uint32_t(upperbound))); //return random number
 }
 
 int calculateDistance(int x1,int y1,int x2,int y2) //calculate distance between two points using pythagoras theorem (a^2 + b^2 = c^2) and return the result as an integer
@@ -40,6 +118,174 @@ int calculateDistance(int x1,int y1,int x2,int y2) //calculate distance between
     return int (sqrt(pow(x1-x2,2)+pow(y1-y2,2))); //rounding the result to an integer value (rounding to the nearest integer) and return the result
 }
 
+//answers distance queries between cities. every backend returns exactly calculateDistance of the two cities,
+//they only differ in how much memory they use and how fast a query is
+class DistanceOracle
+{
+public:
+    virtual ~DistanceOracle() = default;
+    virtual int distance(int from, int to) const = 0;
+    virtual size_t memoryBytes() const = 0;
+    virtual const char* name() const = 0;
+};
+
+//computes every distance from the coordinates when it is asked for, needs no memory beyond the points
+class EuclideanOracle : public DistanceOracle
+{
+public:
+    int distance(int from, int to) const override
+    {
+        return calculateDistance(points[from][0], points[from][1], points[to][0], points[to][1]);
+    }
+    size_t memoryBytes() const override { return 0; }
+    const char* name() const override { return "euclidean"; }
+};
+
+//stores each pair once: row i holds the distances to cities i+1..n-1, n*(n-1)/2 integers in total
+class PackedTriangularOracle : public DistanceOracle
+{
+public:
+    explicit PackedTriangularOracle(int n) : n(n), distances(size_t(n) * (n - 1) / 2)
+    {
+        EuclideanOracle euclidean;
+        for(int i = 0; i < n; i++)
+            for(int j = i + 1; j < n; j++)
+                distances[index(i, j)] = euclidean.distance(i, j);
+    }
+    int distance(int from, int to) const override
+    {
+        if(from == to)
+            return 0;
+        return from < to ? distances[index(from, to)] : distances[index(to, from)];
+    }
+    size_t memoryBytes() const override { return distances.size() * sizeof(int); }
+    const char* name() const override { return "packed triangular"; }
+private:
+    int n;
+    vector<int> distances;
+    size_t index(int i, int j) const //position of the pair (i, j) with i < j
+    {
+        return size_t(i) * (2 * size_t(n) - i - 1) / 2 + (j - i - 1);
+    }
+};
+
+//full n*n matrix of int32, one load per query without any branching, for small instances.
+//int32 takes as much memory as float32 but keeps every distance exact, float32 is only exact up to 2^24
+class DenseMatrixOracle : public DistanceOracle
+{
+public:
+    explicit DenseMatrixOracle(int n) : n(n), distances(size_t(n) * n)
+    {
+        EuclideanOracle euclidean;
+        for(int i = 0; i < n; i++)
+            for(int j = 0; j < n; j++)
+                distances[size_t(i) * n + j] = euclidean.distance(i, j);
+    }
+    int distance(int from, int to) const override
+    {
+        return distances[size_t(from) * n + to];
+    }
+    size_t memoryBytes() const override { return distances.size() * sizeof(int32_t); }
+    const char* name() const override { return "dense int32"; }
+private:
+    int n;
+    vector<int32_t> distances;
+};
+
+//keeps the distances to the k nearest cities of every city, which are the pairs good tours use most,
+//and computes every other distance from the coordinates. the neighbors are found with a uniform grid,
+//so building it stays close to linear in the number of cities
+class NeighborCacheOracle : public DistanceOracle
+{
+public:
+    NeighborCacheOracle(int n, int k) : k(min(k, max(n - 1, 0))), neighbors(size_t(n) * this->k)
+    {
+        if(this->k == 0)
+            return;
+        int min_x = INT_MAX, min_y = INT_MAX, max_x = INT_MIN, max_y = INT_MIN;
+        for(int i = 0; i < n; i++)
+        {
+            min_x = min(min_x, points[i][0]); max_x = max(max_x, points[i][0]);
+            min_y = min(min_y, points[i][1]); max_y = max(max_y, points[i][1]);
+        }
+        //about two cities per cell
+        int cells_per_side = max(1, int(sqrt(n / 2.0)));
+        double cell_width = max(1.0, double(max_x - min_x + 1) / cells_per_side);
+        double cell_height = max(1.0, double(max_y - min_y + 1) / cells_per_side);
+        auto cellOf = [&](int city) {
+            int cx = min(cells_per_side - 1, int((points[city][0] - min_x) / cell_width));
+            int cy = min(cells_per_side - 1, int((points[city][1] - min_y) / cell_height));
+            return make_pair(cx, cy);
+        };
+        vector<vector<int>> cells(size_t(cells_per_side) * cells_per_side);
+        for(int i = 0; i < n; i++)
+        {
+            auto [cx, cy] = cellOf(i);
+            cells[size_t(cy) * cells_per_side + cx].push_back(i);
+        }
+        EuclideanOracle euclidean;
+        vector<pair<int, int>> candidates; //(distance, city)
+        for(int i = 0; i < n; i++)
+        {
+            auto [cx, cy] = cellOf(i);
+            candidates.clear();
+            //grow the square of cells around the city until it holds k other cities and one more ring,
+            //since a city in the next ring can still be closer than the farthest candidate in a corner
+            for(int radius = 0, extra_rings = -1; extra_rings < 1 && radius <= cells_per_side; radius++)
+            {
+                for(int y = cy - radius; y <= cy + radius; y++)
+                    for(int x = cx - radius; x <= cx + radius; x++)
+                    {
+                        if(x < 0 || y < 0 || x >= cells_per_side || y >= cells_per_side)
+                            continue;
+                        if(max(abs(x - cx), abs(y - cy)) != radius) //only the new ring
+                            continue;
+                        for(int city : cells[size_t(y) * cells_per_side + x])
+                            if(city != i)
+                                candidates.emplace_back(euclidean.distance(i, city), city);
+                    }
+                if(int(candidates.size()) >= this->k)
+                    extra_rings++;
+            }
+            partial_sort(candidates.begin(), candidates.begin() + this->k, candidates.end());
+            sort(candidates.begin(), candidates.begin() + this->k, [](const pair<int, int>& a, const pair<int, int>& b) { return a.second < b.second; });
+            for(int j = 0; j < this->k; j++)
+                neighbors[size_t(i) * this->k + j] = {candidates[j].second, candidates[j].first};
+        }
+    }
+    int distance(int from, int to) const override
+    {
+        auto first = neighbors.begin() + size_t(from) * k, last = first + k;
+        auto found = lower_bound(first, last, to, [](const pair<int, int>& neighbor, int city) { return neighbor.first < city; });
+        if(found != last && found->first == to)
+            return found->second; //cached neighbor
+        return calculateDistance(points[from][0], points[from][1], points[to][0], points[to][1]);
+    }
+    size_t memoryBytes() const override { return neighbors.size() * sizeof(pair<int, int>); }
+    const char* name() const override { return "cached neighbors"; }
+private:
+    int k;
+    vector<pair<int, int>> neighbors; //(city, distance) sorted by city, k per city
+};
+
+unique_ptr<DistanceOracle> distances; //every distance query of the algorithm goes through this
+
+//picks a backend for the current cities: 0 chooses by size, 1 euclidean, 2 packed triangular, 3 dense int32, 4 cached neighbors
+void buildDistanceOracle(int backend)
+{
+    if(backend == 0) //dense while it is small, packed up to the old 10000 city limit, the neighbor cache beyond
+        backend = total_cities <= 4096 ? 3 : total_cities <= 10000 ? 2 : 4;
+    if(backend == 2)
+        distances = make_unique<PackedTriangularOracle>(total_cities);
+    else if(backend == 3)
+        distances = make_unique<DenseMatrixOracle>(total_cities);
+    else if(backend == 4)
+        distances = make_unique<NeighborCacheOracle>(total_cities, 16);
+    else
+        distances = make_unique<EuclideanOracle>();
+    cout << "Distance backend: " << distances->name() << ", " << distances->memoryBytes() / (1024.0 * 1024.0) << " MiB\n";
+}
+
 void get() //get the inputs from the file or generate random inputs for the program
 {
     s:
@@ -66,6 +312,12 @@ void get() //get the inputs from the file or generate random inputs for the prog
     if(choice2==1)
         save_population_in_file=true;
 
+    cout<<"Enter the random seed, the same seed repeats the same runs (default 0: random)\n";
+    long long seed;
+    cin>>seed;
+    if(seed>0)
+        random_seed=seed;
+
     if(choice == 1) //if the user wants to give the inputs
     {
         cout<<"Enter the name of the file: ";
@@ -78,13 +330,11 @@ void get() //get the inputs from the file or generate random inputs for the prog
             cout<<"File not found! Try again\n";
             goto s;
         }
-        int i = 0;
-        while(!fin.eof())
-        {
-            fin>>points[i][0]>>points[i][1];
-            i++;
-        }
-        total_cities = i;
+        points.clear();
+        int x, y;
+        while(fin>>x>>y) //read the coordinates until the end of the file
+            points.push_back({x, y});
+        total_cities = int(points.size());
         fin.close();
     }
     else if(choice == 2) //if the user wants to generate the inputs randomly
@@ -99,6 +349,7 @@ void get() //get the inputs from the file or generate random inputs for the prog
         cin>>range; //store the range of the coordinates
         if(range<=0)
             range=100;
+        points.resize(total_cities);
         for(int i = 0;i<total_cities;i++) //generate the random coordinates for the cities
         {
             points[i][0] = generateRandomNumber(range); //generate the random coordinates for the x-coordinate
@@ -112,9 +363,13 @@ void get() //get the inputs from the file or generate random inputs for the prog
         cout<<"Invalid choice! Try Again\n"; //if the user enters an invalid choice
         goto s; //go back to the start of the function to ask the user to give the inputs again.
     }
-    for(int i = 0;i<total_cities;i++)
-        for(int j = 0;j<total_cities;j++)
-            originalGraph[i][j] = calculateDistance(points[i][0],points[i][1],points[j][0],points[j][1]); //calculate the distance between the cities
+    cout<<"Which distance backend do you want to use? (default 0)\n";
+    cout<<"0.automatic\n1.euclidean on the fly\n2.packed triangular matrix\n3.dense int32 matrix\n4.cached nearest neighbors\n";
+    int backend;
+    cin>>backend;
+    if(backend<0 || backend>4)
+        backend=0;
+    buildDistanceOracle(backend); //prepare the distances between the cities
 
     if(total_cities < 15) { //if the number of cities is less than 15 because console window is too small to display the matrix correctly.
         cout<<"\n\t\tCOST MATRIX:\n";
@@ -124,7 +379,7 @@ void get() //get the inputs from the file or generate random inputs for the prog
         {
             cout<<"\nCity"<<i+1<<" "; //print the city number
             for(int j = 0;j<total_cities;j++)
-                cout << "\t" << originalGraph[i][j]; //print the distance between the cities
+                cout << "\t" << distances->distance(i, j); //print the distance between the cities
         }
         cout<<"\n\n";
     }
@@ -157,13 +412,14 @@ int costCalculater(vector<int>& solution) //check if the solution is valid and i
     {
         int j = solution_copy[i];
         int k = solution_copy[(i+1)%total_cities];
-        if(originalGraph[j][k] == 0) //if the cities are not connected
+        int distance = distances->distance(j, k);
+        if(distance == 0) //if the cities are not connected
         {
             return -1; //return -1 if the solution is not valid
         }
         else
         {
-            total_cost += originalGraph[j][k]; //calculate the cost of the solution
+            total_cost += distance; //calculate the cost of the solution
         }
     }
     return total_cost; //return the cost of the solution
@@ -192,7 +448,7 @@ void initialPopulation()
     }
     for(int i=0;i<generations;i++) //loop through the generations
     {
-        shuffle(parent.begin() + 1, parent.begin() + (generateRandomNumber(total_cities - 1) + 1), std::mt19937(std::random_device()())); //shuffle the parent
+        shuffle(parent.begin() + 1, parent.begin() + (generateRandomNumber(total_cities - 1) + 1), randomEngine()); //shuffle the parent
         total_cost = costCalculater(parent); //check if the solution is valid or not
         if(total_cost != -1) //checks if the parent is valid
         {
@@ -459,7 +715,10 @@ int main()
         cout << "\n\n\nRUN " << i+1 << endl;
         clock_t begin_time=clock();
         geneticRun();
-        cout << "Time spent: " << (double)(clock()-begin_time)/CLOCKS_PER_SEC << " seconds" << endl;
+        double seconds=(double)(clock()-begin_time)/CLOCKS_PER_SEC;
+        cout << "Time spent: " << seconds << " seconds" << endl;
+        if(seconds > 0) //clock() can report 0 for very short runs
+            cout << "Generations per second: " << generations/seconds << endl; //speed of the algorithm, to compare changes
         //print the results in the file "results.txt"
         if (save_population_in_file) { //if the user wants to save the population in a file
             ofstream file;